@@ -6,6 +6,8 @@
 
 #include <climits>
 
+#include <thread>
+
 std::minstd_rand rand_engine; // Reasonably quick pseudo-random generator
 
 template <typename Type>
@@ -19,6 +21,116 @@ Type random_in_range(Type start, Type end)
     return static_cast<Type>(start+num);
 }
 
+// Calls func(first, last) for consecutive index ranges covering [0, count),
+// splitting the work across hardware threads when count is big enough.
+template <typename Func>
+void parallel_ranges(std::size_t count, std::size_t min_per_thread, Func func)
+{
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, std::max<std::size_t>(1, count / min_per_thread));
+    if (threads <= 1)
+    {
+        func(std::size_t{0}, count);
+        return;
+    }
+    std::vector<std::thread> workers;
+    std::size_t chunk = (count + threads - 1) / threads;
+    for (std::size_t first = chunk; first < count; first += chunk)
+    {
+        workers.emplace_back(func, first, std::min(first + chunk, count));
+    }
+    // Calling thread does the first range itself.
+    func(std::size_t{0}, std::min(chunk, count));
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+// Calls func(index) for each index in [0, count) on hardware threads. Each
+// thread starts with an equal share of indices and takes them one at a time
+// from the front. A thread that runs out steals the back half of the share
+// of another thread, so threads with slow items don't hold up the rest.
+template <typename Func>
+void work_stealing_for(std::size_t count, Func func)
+{
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, std::max<std::size_t>(1, count));
+    struct Share
+    {
+        std::mutex mutex;
+        std::size_t first = 0;
+        std::size_t last = 0;
+    };
+    std::vector<Share> shares(threads);
+    for (std::size_t thread = 0; thread < threads; ++thread)
+    {
+        shares[thread].first = count * thread / threads;
+        shares[thread].last = count * (thread + 1) / threads;
+    }
+
+    auto work = [&shares, &func, threads](std::size_t self)
+    {
+        Share& own = shares[self];
+        while (true)
+        {
+            std::size_t index = 0;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> lock(own.mutex);
+                if (own.first < own.last)
+                {
+                    index = own.first++;
+                    found = true;
+                }
+            }
+            if (found)
+            {
+                func(index);
+                continue;
+            }
+            // Own share is empty: steal from the next thread that has work.
+            for (std::size_t offset = 1; offset < threads && !found; ++offset)
+            {
+                Share& victim = shares[(self + offset) % threads];
+                std::size_t first = 0;
+                std::size_t last = 0;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (victim.first < victim.last)
+                    {
+                        first = victim.last - (victim.last - victim.first + 1) / 2;
+                        last = victim.last;
+                        victim.last = first;
+                        found = true;
+                    }
+                }
+                if (found)
+                {
+                    std::lock_guard<std::mutex> lock(own.mutex);
+                    own.first = first;
+                    own.last = last;
+                }
+            }
+            if (!found)
+            {
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t thread = 1; thread < threads; ++thread)
+    {
+        workers.emplace_back(work, thread);
+    }
+    // Calling thread is worker 0.
+    work(0);
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+}
 
 Datastructures::Datastructures()
 {
@@ -30,83 +142,136 @@ Datastructures::~Datastructures()
 
 unsigned int Datastructures::town_count()
 {
-    return towns_by_id_.size();
+    return handles_by_id_.size();
 }
 
 void Datastructures::clear_all()
 {
     clear_roads();
-    towns_by_id_ = {};
-
+    landmarks_ = {};
+    landmarks_dirty_ = false;
+    {
+        std::lock_guard<std::mutex> lock(route_trees_mutex_);
+        route_trees_ = {};
+        route_tree_index_ = {};
+        route_tree_towns_ = 0;
+        last_route_sources_[LEAST_TOWNS_ROUTE] = last_route_sources_[SHORTEST_ROUTE] = NO_HANDLE;
+    }
+    components_ = {};
+    town_tree_ = {};
+    towns_by_distance_ = {};
+    handles_by_id_ = {};
+    ids_ = {};
+    names_ = {};
+    coords_ = {};
+    taxes_ = {};
+    gross_taxes_ = {};
+    vassal_forest_ = {};
+    heights_ = {};
+    best_vassals_ = {};
+    heights_dirty_ = {};
+    jumps_ = {};
+    depths_ = {};
+    ++hierarchy_version_;
+    alive_ = {};
+    masters_ = {};
+    vassal_links_ = {};
+    roads_to_ = {};
+    handles_by_name_ = {};
+    name_slots_ = {};
+    towns_by_name_ = {};
+    pending_by_name_ = {};
+    name_versions_ = {};
+    stale_by_name_ = 0;
 }
 
 bool Datastructures::add_town(TownID id, const Name &name, Coord coord, int tax)
 {
-    // Find if town already exists.
-    if (towns_by_id_.find(id) != towns_by_id_.end())
+    // Find if town already exists. Intern new id to next free handle.
+    TownHandle handle = ids_.size();
+    if (!handles_by_id_.insert({id, handle}).second)
     {
         return false;
     }
 
-    // Add town to unordered_map.
-    Cost cost = {INT_MAX, INT_MAX};
-    Town_info town = {id, name, coord, tax, {}, nullptr, {}, WHITE, nullptr, cost};
-    towns_by_id_.insert({id, town});
+    // Add town to the per-town arrays.
+    ids_.push_back(std::move(id));
+    names_.push_back(name);
+    coords_.push_back(coord);
+    taxes_.push_back(tax);
+    gross_taxes_.push_back(tax);
+    vassal_forest_.add(handle, tax);
+    heights_.push_back(1);
+    best_vassals_.push_back(NO_HANDLE);
+    heights_dirty_.push_back(false);
+    // New town is a root: jump pointers stay valid if its entries are added.
+    if (jumps_version_ == hierarchy_version_)
+    {
+        depths_.push_back(0);
+        for (auto& jumps : jumps_)
+        {
+            jumps.push_back(NO_HANDLE);
+        }
+    }
+    alive_.push_back(true);
+    masters_.push_back(NO_HANDLE);
+    vassal_links_.emplace_back();
+    roads_to_.emplace_back();
+    add_component(handle);
+    town_tree_.insert(handle, coord);
+    towns_by_distance_.insert({squared_distance(coord, {0, 0}), handle});
+    name_slots_.push_back(0);
+    add_to_name_index(handle);
+    name_versions_.push_back(0);
+    pending_by_name_.push_back({handle, 0});
     return true;
 }
 
 Name Datastructures::get_town_name(TownID id)
 {
     // Find if town exists.
-    auto town = towns_by_id_.find(id);
-    if (town == towns_by_id_.end())
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
     {
         return NO_NAME;
     }
     // Return name of existing town.
-    Name town_name = town->second.name;
-    return town_name;
+    return names_[town];
 }
 
 Coord Datastructures::get_town_coordinates(TownID id)
 {
     // Find if town exists.
-    auto town = towns_by_id_.find(id);
-    if (town == towns_by_id_.end())
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
     {
         return NO_COORD;
     }
 
     // Return coords of existing town.
-    Coord town_coords = town->second.coords;
-    return town_coords;
+    return coords_[town];
 }
 
 int Datastructures::get_town_tax(TownID id)
 {
     // Find if town exists.
-    auto town = towns_by_id_.find(id);
-    if (town == towns_by_id_.end())
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
     {
         return NO_VALUE;
     }
 
     // Return tax of existing town.
-    int tax = town->second.tax;
-    return tax;
+    return taxes_[town];
 }
 
 std::vector<TownID> Datastructures::all_towns()
 {
     std::vector<TownID> towns_vector = {};
+    towns_vector.reserve(handles_by_id_.size());
 
-    // Check if there are towns.
-    if (towns_by_id_.empty())
-    {
-        return towns_vector;
-    }
-    // Go through the towns in a map. Add TownID to vector.
-    for (const auto& town: towns_by_id_)
+    // Go through the interned towns. Add TownID to vector.
+    for (const auto& town: handles_by_id_)
     {
         towns_vector.push_back(town.first);
     }
@@ -115,264 +280,473 @@ std::vector<TownID> Datastructures::all_towns()
 
 std::vector<TownID> Datastructures::find_towns(const Name &name)
 {
+    // Find towns with the name from name index.
+    auto towns = handles_by_name_.find(name);
+    if (towns == handles_by_name_.end())
+    {
+        return {};
+    }
     std::vector<TownID> towns_vector = {};
-    // Loop through all the towns.
-    for (const auto& town: towns_by_id_)
+    towns_vector.reserve(towns->second.size());
+    for (TownHandle town : towns->second)
     {
-        // Check if town name is one we are trying to find
-        if (town.second.name == name)
-        {
-            towns_vector.push_back(town.first);
-        }
+        towns_vector.push_back(ids_[town]);
     }
     return towns_vector;
 }
 
 bool Datastructures::change_town_name(TownID id, const Name &newname)
 {
-    // Check if town name is found
-    if (towns_by_id_.find(id) != towns_by_id_.end() )
+    // Check if town is found
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
     {
-        // Change town name.
-        towns_by_id_.at(id).name = newname;
-        return true;
+        return false;
     }
-    return false;
+    // Change town name and move town in name index.
+    remove_from_name_index(town);
+    names_[town] = newname;
+    add_to_name_index(town);
+    reorder_by_name(town);
+    return true;
 }
 
 std::vector<TownID> Datastructures::towns_alphabetically()
 {
-    // Make a vector and reserve space pre-emptively.
-    std::vector<TownID> towns = {};
-    towns.reserve(towns_by_id_.size());
+    // Bring name order up to date, then read it.
+    merge_pending_by_name();
 
-    // Add all pair elements to vector.
-    std::vector<std::pair<TownID, Town_info>> elems(towns_by_id_.begin(), towns_by_id_.end());
-
-    // Sort all elements by town name.
-    std::sort(elems.begin(), elems.end(), [] (auto town1, auto town2)
-    {return town1.second.name < town2.second.name; });
-
-    for (const auto& town_pair : elems)
+    std::vector<TownID> towns = {};
+    towns.reserve(towns_by_name_.size());
+    for (Name_order_entry const& entry : towns_by_name_)
     {
-        towns.push_back(town_pair.first);
+        towns.push_back(ids_[entry.town]);
     }
     return towns;
 }
 
 std::vector<TownID> Datastructures::towns_distance_increasing()
 {
-    // Vector for sorted id's and reserve space pre-emptively.
+    // Read towns from distance order.
     std::vector<TownID> townid_sorted = {};
-    std::vector<std::pair<TownID, int>> town_pairs;
-
-    // Vector in which we sort id's. Reserve space pre-emptively.
-    townid_sorted.reserve(towns_by_id_.size());
-    town_pairs.reserve(towns_by_id_.size());
-    for (auto& town : towns_by_id_)
+    townid_sorted.reserve(towns_by_distance_.size());
+    for (auto const& town : towns_by_distance_)
     {
-        int dist = sqrt((town.second.coords.x*town.second.coords.x)+(town.second.coords.y*town.second.coords.y));
-        town_pairs.push_back(std::make_pair(town.first, dist));
-    }
-    std::sort(town_pairs.begin(), town_pairs.end(),[](auto a, auto b){return a.second < b.second;});
-
-    for (const auto& town : town_pairs)
-    {
-        townid_sorted.push_back(town.first);
+        townid_sorted.push_back(ids_[town.second]);
     }
     return townid_sorted;
 }
 
 TownID Datastructures::min_distance()
 {
-    if (towns_by_id_.empty())
+    // Nearest town is first in distance order.
+    if (towns_by_distance_.empty())
     {
         return NO_TOWNID;
     }
-    // Get distance for one town as "starting  point" to start comparing to.
-    Coord xy = towns_by_id_.begin()->second.coords;
-    TownID min_dist_town = towns_by_id_.begin()->first;
-    // Set min distance to first element.
-    int min_dist = sqrt(xy.x*xy.x+xy.y*xy.y);
-    // Compare elements
-    for (const auto& town : towns_by_id_)
-    {
-
-        int x = town.second.coords.x;
-        int y = town.second.coords.y;
-        int current_dist = sqrt(x*x+y*y);
-        if (current_dist < min_dist)
-        {
-            min_dist = current_dist;
-            min_dist_town = town.first;
-        }
-    }
-    return min_dist_town;
+    return ids_[towns_by_distance_.begin()->second];
 }
 
 TownID Datastructures::max_distance()
 {
-    if (towns_by_id_.empty())
+    // Furthest town is last in distance order.
+    if (towns_by_distance_.empty())
     {
         return NO_TOWNID;
     }
-    // Get distance for one town as "starting  point" to start comparing to.
-    Coord xy = towns_by_id_.begin()->second.coords;
-    TownID min_dist_town = towns_by_id_.begin()->first;
-    int min_dist = sqrt(xy.x*xy.x+xy.y*xy.y);
-    // Compare for smallest
-    for (const auto& i : towns_by_id_)
-    {
-        int x = i.second.coords.x;
-        int y = i.second.coords.y;
-        int current_dist = sqrt(x*x+y*y);
-        if (current_dist > min_dist)
-        {
-            min_dist = current_dist;
-            min_dist_town = i.first;
-        }
-    }
-    return min_dist_town;
+    return ids_[towns_by_distance_.rbegin()->second];
 }
 
 bool Datastructures::add_vassalship(TownID vassalid, TownID masterid)
 {
     // Find if vassaltown exists.
-    auto vassal = towns_by_id_.find(vassalid);
-    if (vassal == towns_by_id_.end())
+    TownHandle vassal = find_handle(vassalid);
+    if (vassal == NO_HANDLE)
     {
         return false;
     }
 
-    // Find if vassal already has a master (check nullptr)
-    if (vassal->second.master)
+    // Find if vassal already has a master
+    if (masters_[vassal] != NO_HANDLE)
     {
         return false;
     }
     // Find if mastertown exists.
-    auto master = towns_by_id_.find(masterid);
-    if (master == towns_by_id_.end())
+    TownHandle master = find_handle(masterid);
+    if (master == NO_HANDLE)
+    {
+        return false;
+    }
+
+    // Vassalship can't make a cycle.
+    if (would_cycle(vassal, master))
     {
         return false;
     }
 
     // Make vassalship
-    master->second.vassals.push_back(&vassal->second);
-    vassal->second.master = &master->second;
+    link_vassal(vassal, master);
     return true;
-    // Replace the line below with your implementation
-    // Also uncomment parameters ( /* param */ -> param )
+}
 
+int Datastructures::taxer_path_tax(TownID id)
+{
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
+    {
+        return NO_VALUE;
+    }
+    return static_cast<int>(vassal_forest_.path_tax(town));
 }
 
-std::vector<TownID> Datastructures::get_town_vassals(TownID id)
+bool Datastructures::change_master(TownID vassalid, TownID masterid)
 {
-    // Find if town which vassals we are checking exists.
-    auto masternode = towns_by_id_.find(id);
-    if (masternode == towns_by_id_.end())
+    // Find if towns exist.
+    TownHandle vassal = find_handle(vassalid);
+    TownHandle master = find_handle(masterid);
+    if (vassal == NO_HANDLE || master == NO_HANDLE)
     {
-        return {NO_TOWNID};
+        return false;
+    }
+    TownHandle old_master = masters_[vassal];
+    if (old_master == master)
+    {
+        return true;
+    }
+    // New master can't be vassal itself or in its vassal tree. Checked before
+    // taking vassal from old master, so a rejected change doesn't move it.
+    if (vassal_forest_.is_master_of(vassal, master))
+    {
+        return false;
+    }
+    if (old_master != NO_HANDLE)
+    {
+        unlink_vassal(vassal);
+    }
+    else
+    {
+        // Town without master may still hang under ghost masters.
+        vassal_forest_.cut(vassal);
     }
+    link_vassal(vassal, master);
+    return true;
+}
 
-    // Get vassals of the town.
-    std::vector<Town_info*> vassals = masternode->second.vassals;
-    std::vector<TownID> vassal_ids = {};
+void Datastructures::link_vassal(TownHandle vassal, TownHandle master)
+{
+    append_vassal(master, vassal);
+    masters_[vassal] = master;
+    vassal_forest_.link(vassal, master);
+    propagate_tax(master, tax_to_master(gross_taxes_[vassal]));
+    mark_height_dirty(master);
+    ++hierarchy_version_;
+}
+
+void Datastructures::unlink_vassal(TownHandle vassal)
+{
+    TownHandle master = masters_[vassal];
+    detach_vassal(master, vassal);
+    masters_[vassal] = NO_HANDLE;
+    vassal_forest_.cut(vassal);
+    propagate_tax(master, -tax_to_master(gross_taxes_[vassal]));
+    mark_height_dirty(master);
+    ++hierarchy_version_;
+}
 
-    // Check if there are no vassals.
-    if (vassals.size() == 0)
+bool Datastructures::would_cycle(TownHandle vassal, TownHandle master)
+{
+    // Town without master can only hang under removed (ghost) towns in vassal
+    // forest. Cut it, so that it is root of its own tree.
+    vassal_forest_.cut(vassal);
+    return vassal_forest_.find_root(master) == vassal;
+}
+
+std::vector<TownID> Datastructures::get_town_vassals(TownID id)
+{
+    // Find if town which vassals we are checking exists.
+    TownHandle masternode = find_handle(id);
+    if (masternode == NO_HANDLE)
     {
-        return {};
+        return {NO_TOWNID};
     }
 
     // Put vassals in a vector.
-    for (Town_info* vassal : vassals)
+    std::vector<TownID> vassal_ids = {};
+    vassal_ids.reserve(vassal_links_[masternode].count);
+    for (TownHandle vassal = vassal_links_[masternode].first; vassal != NO_HANDLE;
+         vassal = vassal_links_[vassal].next)
     {
-        vassal_ids.push_back(vassal->id);
+        vassal_ids.push_back(ids_[vassal]);
     }
     return vassal_ids;
 }
 
+Datastructures::Vassals_view Datastructures::get_town_vassals_view(TownID id) const
+{
+    return {this, find_handle(id)};
+}
+
+bool Datastructures::get_town_vassals(TownID id, std::vector<TownID>& vassals) const
+{
+    TownHandle town = find_handle(id);
+    Vassals_view view(this, town);
+    vassals.assign(view.begin(), view.end());
+    return town != NO_HANDLE;
+}
+
 std::vector<TownID> Datastructures::taxer_path(TownID id)
 {
     // Find if town exists.
-    auto vassalnode = towns_by_id_.find(id);
-    if (vassalnode == towns_by_id_.end())
+    TownHandle vassalnode = find_handle(id);
+    if (vassalnode == NO_HANDLE)
     {
         return {NO_TOWNID};
     }
-    std::vector<TownID> taxer_town_ids = {};
+    // Add vassaltown and its masters to a vector until there is no master.
+    Taxer_path_view path(this, vassalnode);
+    return std::vector<TownID>(path.begin(), path.end());
+}
+
+Datastructures::Taxer_path_view Datastructures::taxer_path_view(TownID id)
+{
+    return {this, find_handle(id)};
+}
+
+bool Datastructures::is_under(TownID vassalid, TownID masterid)
+{
+    // Find if towns exist.
+    TownHandle vassal = find_handle(vassalid);
+    TownHandle master = find_handle(masterid);
+    if (vassal == NO_HANDLE || master == NO_HANDLE)
+    {
+        return false;
+    }
+    update_jumps();
+    // Master has to be above vassal, on its master chain.
+    if (depths_[vassal] <= depths_[master])
+    {
+        return false;
+    }
+    return lift(vassal, depths_[vassal] - depths_[master]) == master;
+}
+
+TownID Datastructures::common_master(TownID id1, TownID id2)
+{
+    // Find if towns exist.
+    TownHandle town1 = find_handle(id1);
+    TownHandle town2 = find_handle(id2);
+    if (town1 == NO_HANDLE || town2 == NO_HANDLE)
+    {
+        return NO_TOWNID;
+    }
+    update_jumps();
+    // Lift lower town to the same depth.
+    if (depths_[town1] < depths_[town2])
+    {
+        std::swap(town1, town2);
+    }
+    town1 = lift(town1, depths_[town1] - depths_[town2]);
+    if (town1 == town2)
+    {
+        return ids_[town1];
+    }
+    // Lift both as long as they don't meet.
+    for (std::size_t level = jumps_.size(); level-- > 0;)
+    {
+        if (jumps_[level][town1] != jumps_[level][town2])
+        {
+            town1 = jumps_[level][town1];
+            town2 = jumps_[level][town2];
+        }
+    }
+    // Towns in different vassal trees have no common master.
+    if (masters_[town1] == NO_HANDLE)
+    {
+        return NO_TOWNID;
+    }
+    return ids_[masters_[town1]];
+}
+
+int Datastructures::depth(TownID id)
+{
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
+    {
+        return NO_VALUE;
+    }
+    update_jumps();
+    return depths_[town];
+}
+
+void Datastructures::update_jumps()
+{
+    if (jumps_version_ == hierarchy_version_)
+    {
+        return;
+    }
+    // Depths: walk up to a town with known depth, then assign on the way back.
+    std::uint32_t const unknown = std::numeric_limits<std::uint32_t>::max();
+    depths_.assign(ids_.size(), unknown);
+    std::uint32_t max_depth = 0;
+    std::vector<TownHandle> chain;
+    for (TownHandle town = 0; town < ids_.size(); ++town)
+    {
+        TownHandle top = town;
+        for (; top != NO_HANDLE && depths_[top] == unknown; top = masters_[top])
+        {
+            chain.push_back(top);
+        }
+        std::uint32_t depth = top == NO_HANDLE ? 0 : depths_[top] + 1;
+        for (auto chain_town = chain.rbegin(); chain_town != chain.rend(); ++chain_town, ++depth)
+        {
+            depths_[*chain_town] = depth;
+        }
+        chain.clear();
+        max_depth = std::max(max_depth, depths_[town]);
+    }
 
-    // Add vassaltown to vector.
-    taxer_town_ids.push_back(vassalnode->second.id);
+    // Enough levels to jump over the deepest chain.
+    std::size_t levels = 1;
+    while ((std::uint64_t{1} << levels) <= max_depth)
+    {
+        ++levels;
+    }
+    jumps_.resize(levels);
+    jumps_[0] = masters_;
+    for (std::size_t level = 1; level < levels; ++level)
+    {
+        auto const& half = jumps_[level - 1];
+        auto& jumps = jumps_[level];
+        jumps.resize(ids_.size());
+        for (TownHandle town = 0; town < ids_.size(); ++town)
+        {
+            jumps[town] = half[town] == NO_HANDLE ? NO_HANDLE : half[half[town]];
+        }
+    }
+    jumps_version_ = hierarchy_version_;
+}
 
-    // Add masters to a vector until pointer is nullptr.
-    Town_info* next_town = vassalnode->second.master;
-    while (next_town != nullptr)
+TownHandle Datastructures::lift(TownHandle town, std::uint32_t levels) const
+{
+    for (std::size_t level = 0; levels != 0 && town != NO_HANDLE; ++level, levels >>= 1)
     {
-        taxer_town_ids.push_back(next_town->id);
-        next_town = next_town->master;
+        if (levels & 1)
+        {
+            town = jumps_[level][town];
+        }
     }
-    return taxer_town_ids;
+    return town;
 }
 
 bool Datastructures::remove_town(TownID id)
 {
     // Check if town is found.
-    auto pair_to_remove = towns_by_id_.find(id);
-    if (pair_to_remove == towns_by_id_.end())
+    auto pair_to_remove = handles_by_id_.find(id);
+    if (pair_to_remove == handles_by_id_.end())
     {
         return false;
     }
 
     // Node to remove.
-    Town_info* node_to_remove = &pair_to_remove->second;
+    TownHandle node_to_remove = pair_to_remove->second;
     // Master of node to be removed.
-    Town_info* masternode = pair_to_remove->second.master;
-    // Vassals of node we want to remove.
-    std::vector<Town_info*> vassal_nodes = pair_to_remove->second.vassals;
+    TownHandle masternode = masters_[node_to_remove];
+    bool has_vassals = vassal_links_[node_to_remove].first != NO_HANDLE;
 
-    // Case when node to remove doesn't have a masternode.
-    if (masternode == nullptr)
+    // Vassals of removed node get its master (or none) as their new master.
+    for (TownHandle vassal = vassal_links_[node_to_remove].first; vassal != NO_HANDLE;)
     {
-        // Now all vassalnodes point to null.
-        for (Town_info* vassal : vassal_nodes)
+        TownHandle next = vassal_links_[vassal].next;
+        masters_[vassal] = masternode;
+        if (masternode == NO_HANDLE)
         {
-            vassal->master = nullptr;
+            vassal_links_[vassal].prev = NO_HANDLE;
+            vassal_links_[vassal].next = NO_HANDLE;
         }
+        vassal = next;
     }
-    // Case when node to remove has a master.
-    else if (masternode != nullptr)
+    if (masternode != NO_HANDLE)
     {
-        // Add new master to vassals.
-        for (Town_info* vassal : vassal_nodes)
+        // Replace removed town with its vassals at the end of master's vassals.
+        detach_vassal(masternode, node_to_remove);
+        splice_vassals(node_to_remove, masternode);
+
+        // Master now gets taxes of removed town's vassals instead of its tax.
+        // Removed town stays between them in vassal forest as a ghost.
+        int vassal_taxes = gross_taxes_[node_to_remove] - taxes_[node_to_remove];
+        propagate_tax(masternode, vassal_taxes - tax_to_master(gross_taxes_[node_to_remove]));
+        mark_height_dirty(masternode);
+    }
+
+    vassal_forest_.set_tax(node_to_remove, 0);
+
+    // Remove roads of the town. Last road of its adjacency list is removed
+    // first, so nothing has to be moved in it. Roads may have held its
+    // component together.
+    if (!roads_to_[node_to_remove].empty())
+    {
+        mark_component_dirty(node_to_remove);
+        while (!roads_to_[node_to_remove].empty())
         {
-            vassal->master = masternode;
-            masternode->vassals.push_back(vassal);
+            erase_road(roads_to_[node_to_remove].back().road);
         }
-        // Remove old master from masternodes vassals.
-        auto res = std::find(masternode->vassals.begin(),masternode->vassals.end(), node_to_remove);
-        masternode->vassals.erase(res);
-    }
-    // Delete pair.
-    pair_to_remove->second.master = nullptr;
-    pair_to_remove->second.vassals = {};
-    towns_by_id_.erase(pair_to_remove);
+        invalidate_road_graph();
+        landmarks_dirty_ = true;
+    }
+
+    // Mark handle dead.
+    town_tree_.remove(node_to_remove);
+    towns_by_distance_.erase({squared_distance(coords_[node_to_remove], {0, 0}), node_to_remove});
+    remove_from_name_index(node_to_remove);
+    // Only vassals get new masters. Entries of the removed town itself are
+    // never read again.
+    if (has_vassals)
+    {
+        ++hierarchy_version_;
+    }
+    ++name_versions_[node_to_remove];
+    ++stale_by_name_;
+    masters_[node_to_remove] = NO_HANDLE;
+    vassal_links_[node_to_remove] = {};
+    alive_[node_to_remove] = false;
+    handles_by_id_.erase(pair_to_remove);
     return true;
 }
 
 std::vector<TownID> Datastructures::towns_nearest(Coord coord)
 {
+    // Calculate squared distance of each town once, then sort by it.
+    std::vector<std::pair<long long, TownHandle>> elems;
+    elems.reserve(handles_by_id_.size());
+    for (TownHandle town = 0; town < coords_.size(); ++town)
+    {
+        if (alive_[town])
+        {
+            elems.push_back({squared_distance(coords_[town], coord), town});
+        }
+    }
+    std::sort(elems.begin(), elems.end(), [] (auto const& a, auto const& b)
+    {return a.first < b.first;});
+
     // Vector for sorted id's.
     std::vector<TownID> towns_by_distance = {};
-    towns_by_distance.reserve(towns_by_id_.size());
-    // Copy all pairs into new vector which we then sort.
-    std::vector<std::pair<TownID, Town_info>> elems(towns_by_id_.begin(), towns_by_id_.end());
-    std::sort(elems.begin(), elems.end(), [this, coord] (auto a, auto b)
-    {return get_distance_from_coord(a, coord) < get_distance_from_coord(b, coord);});
-
+    towns_by_distance.reserve(elems.size());
     for (const auto& i : elems)
     {
-        towns_by_distance.push_back(i.first);
+        towns_by_distance.push_back(ids_[i.second]);
+    }
+    return towns_by_distance;
+}
+
+std::vector<TownID> Datastructures::towns_nearest(Coord coord, unsigned int k)
+{
+    // Rebuild tree first if most of it are removed towns.
+    town_tree_.rebalance();
+
+    std::vector<TownID> towns_by_distance = {};
+    for (TownHandle town : town_tree_.nearest(coord, k))
+    {
+        towns_by_distance.push_back(ids_[town]);
     }
     return towns_by_distance;
 }
@@ -380,551 +754,2577 @@ std::vector<TownID> Datastructures::towns_nearest(Coord coord)
 std::vector<TownID> Datastructures::longest_vassal_path(TownID id)
 {
     // Find if town exists
-    auto node = towns_by_id_.find(id);
-    if (node == towns_by_id_.end())
+    TownHandle node = find_handle(id);
+    if (node == NO_HANDLE)
     {
         return {NO_TOWNID};
     }
-    // Find longest vassal path recursively.
-    std::vector<TownID> longest = recursive_find_longest(&node->second);
-
-    // Reverse vector elements
-    std::reverse(longest.begin(), longest.end());
+    // Bring heights up to date and follow best vassals.
+    update_heights(node);
+    std::vector<TownID> longest = {};
+    longest.reserve(heights_[node]);
+    for (TownHandle town = node; town != NO_HANDLE; town = best_vassals_[town])
+    {
+        longest.push_back(ids_[town]);
+    }
     return longest;
 }
 
 int Datastructures::total_net_tax(TownID id)
 {
     // Find if town exists.
-    auto node = towns_by_id_.find(id);
-    if (node == towns_by_id_.end())
+    TownHandle node = find_handle(id);
+    if (node == NO_HANDLE)
     {
         return NO_VALUE;
     }
-    // Calculate total_net_tax recursively.
-    int total_net_tax = recursive_total_net_tax(&node->second);
-    // Tax paid to master (if exists) isn't calculated and sub-
-    // tracted yet. Calculate and subtract it.
-    int tax_to_master;
-    if (node->second.master != nullptr)
+    // Cached tax income. Tax paid to master (if exists) is subtracted.
+    int total_net_tax = gross_taxes_[node];
+    if (masters_[node] != NO_HANDLE)
     {
-        tax_to_master = total_net_tax * 0.1;
-        total_net_tax -= tax_to_master;
+        total_net_tax -= tax_to_master(total_net_tax);
     }
     return total_net_tax;
 }
 
-int Datastructures::get_distance_from_coord(const std::pair<TownID, Town_info> &town, Coord coord)
+void Datastructures::add_to_name_index(TownHandle town)
 {
-    // Get x and y of town.
-    int x1 = town.second.coords.x;
-    int y1 = town.second.coords.y;
-    // Get x and y of coord to compare to.
-    int x2 = coord.x;
-    int y2 = coord.y;
-    return sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2));
-
+    auto& towns = handles_by_name_[names_[town]];
+    name_slots_[town] = towns.size();
+    towns.push_back(town);
 }
 
-std::vector<TownID> Datastructures::recursive_find_longest(Town_info* node)
+void Datastructures::remove_from_name_index(TownHandle town)
 {
-    std::vector<TownID> best;
-    // Go to leafs recursively
-    for (Town_info* child : node->vassals)
+    auto name_towns = handles_by_name_.find(names_[town]);
+    auto& towns = name_towns->second;
+    // Move last town of the list to the slot of removed town.
+    std::uint32_t slot = name_slots_[town];
+    towns[slot] = towns.back();
+    name_slots_[towns[slot]] = slot;
+    towns.pop_back();
+    if (towns.empty())
     {
-        // Get next vassal's path and compare it to current longest.
-        auto next = recursive_find_longest(child);
-        if (next.size() > best.size())
-        {
-            best = std::move(next);
-        }
+        handles_by_name_.erase(name_towns);
     }
-    best.push_back(node->id);
-    return best;
 }
 
-int Datastructures::recursive_total_net_tax(Town_info* node)
+void Datastructures::reorder_by_name(TownHandle town)
 {
-    int net_tax = 0;
-    // Return tax if vassal doesn't have any more vassals.
-    if (node->vassals.empty())
-    {
-        return node->tax;
-    }
-    // Otherwise, go through all vassals recursively
-    for (Town_info* vassal : node->vassals)
-    {
-        int net_tax_from_vassals = recursive_total_net_tax(vassal) * 0.1;
-        // Sum tax from vassals
-        net_tax += net_tax_from_vassals;
-    }
-    // Overall tax income is income from town and income from vassals.
-    int money = net_tax + node->tax;
-    return money;
+    ++name_versions_[town];
+    ++stale_by_name_;
+    pending_by_name_.push_back({town, name_versions_[town]});
 }
 
-
-//
-// Phase 2 operations
-//
-
-int Datastructures::get_road_length(Town_info* town1, Town_info* town2)
+void Datastructures::merge_pending_by_name()
 {
-    // Get coordinates of town 1
-    int x1 = town1->coords.x;
-    int y1 = town1->coords.y;
-
-    // Get coordinates of town 2
-    int x2 = town2->coords.x;
-    int y2 = town2->coords.y;
-
-    // Now calculate road length.
-    return sqrt((x1-x2)*(x1-x2)+(y1-y2)*(y1-y2));
+    if (pending_by_name_.empty() && stale_by_name_ == 0)
+    {
+        return;
+    }
+    auto stale = [this] (Name_order_entry const& entry)
+    {return !alive_[entry.town] || name_versions_[entry.town] != entry.version;};
+    auto by_name = [this] (Name_order_entry const& entry1, Name_order_entry const& entry2)
+    {return names_[entry1.town] < names_[entry2.town];};
+
+    // Drop stale entries from both lists and sort only the pending towns.
+    towns_by_name_.erase(std::remove_if(towns_by_name_.begin(), towns_by_name_.end(), stale),
+                         towns_by_name_.end());
+    pending_by_name_.erase(std::remove_if(pending_by_name_.begin(), pending_by_name_.end(), stale),
+                           pending_by_name_.end());
+    std::sort(pending_by_name_.begin(), pending_by_name_.end(), by_name);
+
+    // Merge sorted lists.
+    std::size_t middle = towns_by_name_.size();
+    towns_by_name_.insert(towns_by_name_.end(), pending_by_name_.begin(), pending_by_name_.end());
+    std::inplace_merge(towns_by_name_.begin(), towns_by_name_.begin() + middle, towns_by_name_.end(), by_name);
+    pending_by_name_.clear();
+    stale_by_name_ = 0;
 }
 
-void Datastructures::relax_A(Town_info* u, Town_info* v, Town_info* g)
+TownHandle Datastructures::find_handle(const TownID &id) const
 {
-    // Calculate new cost estimates for A* algorithm.
-    // updates pi pointers if better route is found. Also updates
-    // distance estimates.
-    if (v->cost.d > (u->cost.d + get_road_length(u, v)) )
+    auto town = handles_by_id_.find(id);
+    if (town == handles_by_id_.end())
     {
-        v->cost.d = (u->cost.d + get_road_length(u, v));
-        v->cost.de = (v->cost.d + min_est(v, g));
-        v->pi = u;
+        return NO_HANDLE;
     }
+    return town->second;
 }
 
-int Datastructures::min_est(Town_info* v, Town_info* g)
+long long Datastructures::squared_distance(Coord coord1, Coord coord2)
 {
-    // Calculates minimum estimate for road length. Calculation is made
-    // by using straight line from current town v to goal town g.
-    return get_road_length(v, g);
+    long long dx = static_cast<long long>(coord1.x) - coord2.x;
+    long long dy = static_cast<long long>(coord1.y) - coord2.y;
+    return dx * dx + dy * dy;
 }
 
-void Datastructures::clear_roads()
+void Datastructures::Vassal_forest::add(TownHandle town, int tax)
 {
-    // Goes through all the towns.
-    for (auto& town : towns_by_id_)
+    if (nodes.size() <= town)
     {
-        // Goes through roads of town.
-        for (auto& road : town.second.roads_to)
-        {
-            // Make ptr null just in case
-            road = nullptr;
-        }
-        // Empty roads vector.
-        town.second.roads_to = {};
+        nodes.resize(town + 1);
     }
-    // Empty another data structure.
-    roads_ = {};
+    nodes[town] = {{NO_HANDLE, NO_HANDLE}, NO_HANDLE, tax, tax};
 }
 
-std::vector<std::pair<TownID, TownID>> Datastructures::all_roads()
+void Datastructures::Vassal_forest::set_tax(TownHandle town, int tax)
 {
-    // Get roads from different data structure.
-    return roads_;
+    // Town is splay root after access, so only its own sum changes.
+    access(town);
+    nodes[town].tax = tax;
+    update(town);
 }
 
-bool Datastructures::add_road(TownID town1, TownID town2)
+void Datastructures::Vassal_forest::link(TownHandle town, TownHandle master)
 {
-    // Find if town1 exists.
-    auto town1_node = towns_by_id_.find(town1);
-    if (town1_node == towns_by_id_.end())
-    {
-        return false;
-    }
-    // Find if town2 exists.
-    auto town2_node = towns_by_id_.find(town2);
-    if (town2_node == towns_by_id_.end())
+    // Town is root of its tree, so after access it is alone on its path.
+    access(town);
+    nodes[town].parent = master;
+}
+
+void Datastructures::Vassal_forest::cut(TownHandle town)
+{
+    // After access, masters of town are its left subtree.
+    access(town);
+    TownHandle masters = nodes[town].children[0];
+    if (masters != NO_HANDLE)
     {
-        return false;
+        nodes[masters].parent = NO_HANDLE;
+        nodes[town].children[0] = NO_HANDLE;
+        update(town);
     }
-    // Check if adding road to town itself. This is not wanted.
-    if (town1 == town2)
+}
+
+TownHandle Datastructures::Vassal_forest::find_root(TownHandle town)
+{
+    // Root is the shallowest town on the path, leftmost in splay tree.
+    access(town);
+    while (nodes[town].children[0] != NO_HANDLE)
     {
-        return false;
+        town = nodes[town].children[0];
     }
-    // Lastly we have to check if road already exists. If it does, we don't add.
-    for (auto& road_to_town : town1_node->second.roads_to)
+    splay(town);
+    return town;
+}
+
+bool Datastructures::Vassal_forest::is_master_of(TownHandle master, TownHandle town)
+{
+    // After access, masters of town are the other towns in its splay tree.
+    // Splaying master there takes town from the splay root.
+    access(town);
+    splay(master);
+    return master == town || !is_splay_root(town);
+}
+
+long long Datastructures::Vassal_forest::path_tax(TownHandle town)
+{
+    access(town);
+    return nodes[town].tax_sum;
+}
+
+bool Datastructures::Vassal_forest::is_splay_root(TownHandle town) const
+{
+    TownHandle parent = nodes[town].parent;
+    return parent == NO_HANDLE || (nodes[parent].children[0] != town && nodes[parent].children[1] != town);
+}
+
+void Datastructures::Vassal_forest::update(TownHandle town)
+{
+    Node& node = nodes[town];
+    node.tax_sum = node.tax;
+    for (TownHandle child : node.children)
     {
-        if (road_to_town == &town2_node->second)
+        if (child != NO_HANDLE)
         {
-            return false;
+            node.tax_sum += nodes[child].tax_sum;
         }
     }
-    std::pair<TownID, TownID> road;
+}
 
-    // Add roads to both ways.
-    town1_node->second.roads_to.push_back(&town2_node->second);
-    town2_node->second.roads_to.push_back(&town1_node->second);
+void Datastructures::Vassal_forest::rotate(TownHandle town)
+{
+    TownHandle parent = nodes[town].parent;
+    TownHandle grandparent = nodes[parent].parent;
+    bool right = nodes[parent].children[1] == town;
 
-    // Add to different data structure depending on ID
-    if (town1_node->second.id < town2_node->second.id)
+    // Town takes place of parent, also as a path-parent link.
+    if (!is_splay_root(parent))
     {
-        road.first = town1_node->second.id;
-        road.second = town2_node->second.id;
+        Node& grand = nodes[grandparent];
+        grand.children[grand.children[1] == parent] = town;
     }
-    else
+    nodes[town].parent = grandparent;
+
+    // Inner child of town moves to parent.
+    TownHandle inner = nodes[town].children[!right];
+    nodes[parent].children[right] = inner;
+    if (inner != NO_HANDLE)
     {
-        // Add in reverse order
-        road.first = town2_node->second.id;
-        road.second = town1_node->second.id;
+        nodes[inner].parent = parent;
     }
-    roads_.push_back(road);
-
-    return true;
+    nodes[town].children[!right] = parent;
+    nodes[parent].parent = town;
+    update(parent);
+    update(town);
 }
 
-std::vector<TownID> Datastructures::get_roads_from(TownID id)
+void Datastructures::Vassal_forest::splay(TownHandle town)
 {
-    // Get if town is found.
-    auto town_node = towns_by_id_.find(id);
-    if (town_node == towns_by_id_.end())
+    while (!is_splay_root(town))
     {
-        return {NO_TOWNID};
+        TownHandle parent = nodes[town].parent;
+        if (!is_splay_root(parent))
+        {
+            TownHandle grandparent = nodes[parent].parent;
+            bool zig_zig = (nodes[parent].children[1] == town) == (nodes[grandparent].children[1] == parent);
+            rotate(zig_zig ? parent : town);
+        }
+        rotate(town);
     }
-    // Now we go through the roads!
-    std::vector<TownID> all_of_roads = {};
+}
 
-    // Reserve for roads.
-    all_of_roads.reserve(town_node->second.roads_to.size());
+void Datastructures::Vassal_forest::access(TownHandle town)
+{
+    // Make path from root to town preferred, with nothing below town.
+    TownHandle below = NO_HANDLE;
+    for (TownHandle current = town; current != NO_HANDLE; current = nodes[current].parent)
+    {
+        splay(current);
+        nodes[current].children[1] = below;
+        update(current);
+        below = current;
+    }
+    splay(town);
+}
 
-    // Go through roads.
-    for (auto& road : town_node->second.roads_to)
+void Datastructures::append_vassal(TownHandle master, TownHandle vassal)
+{
+    Vassal_links& links = vassal_links_[master];
+    vassal_links_[vassal].prev = links.last;
+    vassal_links_[vassal].next = NO_HANDLE;
+    if (links.last == NO_HANDLE)
     {
-        all_of_roads.push_back(road->id);
+        links.first = vassal;
     }
-    return all_of_roads;
+    else
+    {
+        vassal_links_[links.last].next = vassal;
+    }
+    links.last = vassal;
+    ++links.count;
 }
 
-std::vector<TownID> Datastructures::any_route(TownID fromid, TownID toid)
+void Datastructures::detach_vassal(TownHandle master, TownHandle vassal)
 {
-    return least_towns_route(fromid, toid);
+    Vassal_links& links = vassal_links_[master];
+    Vassal_links& vassal_links = vassal_links_[vassal];
+    // Link neighbours (or ends of the list) to each other.
+    (vassal_links.prev == NO_HANDLE ? links.first : vassal_links_[vassal_links.prev].next) = vassal_links.next;
+    (vassal_links.next == NO_HANDLE ? links.last : vassal_links_[vassal_links.next].prev) = vassal_links.prev;
+    vassal_links.prev = NO_HANDLE;
+    vassal_links.next = NO_HANDLE;
+    --links.count;
 }
 
-bool Datastructures::remove_road(TownID town1, TownID town2)
+void Datastructures::splice_vassals(TownHandle town, TownHandle master)
 {
-    // Check if towns exist.
-    auto town1_node = towns_by_id_.find(town1);
-    if (town1_node == towns_by_id_.end())
+    Vassal_links& from = vassal_links_[town];
+    Vassal_links& to = vassal_links_[master];
+    if (from.first == NO_HANDLE)
+    {
+        return;
+    }
+    // Chain first vassal of town after last vassal of master.
+    vassal_links_[from.first].prev = to.last;
+    (to.last == NO_HANDLE ? to.first : vassal_links_[to.last].next) = from.first;
+    to.last = from.last;
+    to.count += from.count;
+    from = {};
+}
+
+void Datastructures::mark_height_dirty(TownHandle town)
+{
+    // Masters of a dirty town are already dirty.
+    for (; town != NO_HANDLE && !heights_dirty_[town]; town = masters_[town])
     {
-        return false;
+        heights_dirty_[town] = true;
     }
-    // Find if town2 exists.
-    auto town2_node = towns_by_id_.find(town2);
-    if (town2_node == towns_by_id_.end())
+}
+
+void Datastructures::update_heights(TownHandle town)
+{
+    if (!heights_dirty_[town])
     {
-        return false;
+        return;
     }
-
-    bool is_road_found = false;
-    int at_index = 0;
-    // Find if road exists and remove it
-    std::vector<Town_info*>* vector = &town1_node->second.roads_to;
-    for (auto& to_town : town1_node->second.roads_to)
+    // Post-order with explicit stack of towns and their next vassal.
+    std::vector<std::pair<TownHandle, TownHandle>> stack = {{town, vassal_links_[town].first}};
+    while (!stack.empty())
     {
-        if (to_town == &town2_node->second)
+        TownHandle current = stack.back().first;
+        TownHandle vassal = stack.back().second;
+        if (vassal != NO_HANDLE)
         {
-            vector->erase(vector->begin() + at_index);
-            is_road_found = true;
+            // Go only into dirty vassals, clean ones are up to date.
+            stack.back().second = vassal_links_[vassal].next;
+            if (heights_dirty_[vassal])
+            {
+                stack.push_back({vassal, vassal_links_[vassal].first});
+            }
+            continue;
         }
-        at_index++;
-    }
-    at_index = 0;
-    vector = &town2_node->second.roads_to;
-    // Do the same to different town.
-    for (auto& to_town : town2_node->second.roads_to)
-    {
-        if (to_town == &town1_node->second)
+        // All vassals are done. Earliest vassal wins ties.
+        std::uint32_t height = 1;
+        TownHandle best = NO_HANDLE;
+        for (vassal = vassal_links_[current].first; vassal != NO_HANDLE; vassal = vassal_links_[vassal].next)
         {
-            vector->erase(vector->begin() + at_index);
+            if (heights_[vassal] + 1 > height)
+            {
+                height = heights_[vassal] + 1;
+                best = vassal;
+            }
         }
-        at_index++;
+        heights_[current] = height;
+        best_vassals_[current] = best;
+        heights_dirty_[current] = false;
+        stack.pop_back();
     }
-    at_index = 0;
-    for (auto& road : roads_)
+}
+
+int Datastructures::tax_to_master(int gross_tax)
+{
+    return gross_tax * 0.1;
+}
+
+void Datastructures::propagate_tax(TownHandle town, int change)
+{
+    while (change != 0)
     {
-        if (road.first == town1 && road.second == town2)
+        int old_tax = tax_to_master(gross_taxes_[town]);
+        gross_taxes_[town] += change;
+        if (masters_[town] == NO_HANDLE)
         {
-            roads_.erase(roads_.begin() + at_index);
+            return;
         }
-        if (road.first == town2 && road.second == town1)
-        {
-            roads_.erase(roads_.begin() + at_index);
-        }
-        at_index++;
+        // Master's income changes only by change of tax paid to it.
+        change = tax_to_master(gross_taxes_[town]) - old_tax;
+        town = masters_[town];
     }
-
-    return is_road_found;
 }
 
-std::vector<TownID> Datastructures::least_towns_route(TownID fromid, TownID toid)
-{
-    // Check if towns exist.
-    auto town1_node = towns_by_id_.find(fromid);
-    auto town2_node = towns_by_id_.find(toid);
 
-    if (town1_node == towns_by_id_.end())
+//
+// Phase 2 operations
+//
+
+void Datastructures::Route_workspace::begin(std::size_t town_capacity)
+{
+    // Grow arrays for towns added since last query.
+    if (stamps.size() < town_capacity)
     {
-        return {NO_TOWNID};
+        stamps.resize(town_capacity, 0);
+        colours.resize(town_capacity);
+        pis.resize(town_capacity);
+        costs.resize(town_capacity);
+        nexts.resize(town_capacity);
+        sides.resize(town_capacity);
+        heap_positions.resize(town_capacity);
     }
-    if (town2_node == towns_by_id_.end())
+    // New epoch invalidates all entries. On wrap-around stamps must be cleared once.
+    if (++epoch == 0)
     {
-        return {NO_TOWNID};
+        std::fill(stamps.begin(), stamps.end(), 0);
+        epoch = 1;
     }
+}
 
-    // Initialize nodes.
-    for (auto& town : towns_by_id_)
+void Datastructures::Route_workspace::touch(TownHandle town)
+{
+    if (stamps[town] != epoch)
     {
-        town.second.colour = WHITE;
-        town.second.pi = nullptr;
+        stamps[town] = epoch;
+        colours[town] = WHITE;
+        pis[town] = NO_HANDLE;
+        costs[town] = {NO_LENGTH, NO_LENGTH, 0};
+        nexts[town] = NO_HANDLE;
+        sides[town] = 0;
+        heap_positions[town] = std::numeric_limits<std::uint32_t>::max();
     }
+}
 
-    // Queue for town nodes.
-    std::queue<Town_info*> town_queue;
+Datastructures::Route_workspace& Datastructures::route_workspace()
+{
+    thread_local Route_workspace workspace;
+    return workspace;
+}
+
+Datastructures::Town_heap::Town_heap(Route_workspace& ws)
+    : ws_{ws}, items_{ws.heap_items}
+{
+    items_.clear();
+}
 
-    // Vector for TownID.
-    std::vector<TownID> route;
+void Datastructures::Town_heap::push_or_decrease(TownHandle town, Heap_key key)
+{
+    std::uint32_t& pos = ws_.heap_position(town);
+    if (pos == NOT_IN_HEAP)
+    {
+        // New town goes to the end and moves up.
+        items_.push_back({key, town});
+        pos = items_.size() - 1;
+        sift_up(pos);
+    }
+    else if (key < items_[pos].first)
+    {
+        // Smaller key can only move town up.
+        items_[pos].first = key;
+        sift_up(pos);
+    }
+}
 
-    // First node
-    Town_info* starting_node = &towns_by_id_.at(fromid);
+TownHandle Datastructures::Town_heap::pop()
+{
+    TownHandle top = items_.front().second;
+    ws_.heap_position(top) = NOT_IN_HEAP;
+    auto last = items_.back();
+    items_.pop_back();
+    if (!items_.empty())
+    {
+        place(0, last);
+        sift_down(0);
+    }
+    return top;
+}
 
-    // We start processing first node. Push it to queue as well.
-    starting_node->colour = GRAY;
-    town_queue.push(starting_node);
-    Town_info* current_node;
-    while (!town_queue.empty())
+void Datastructures::Town_heap::sift_up(std::size_t pos)
+{
+    auto item = items_[pos];
+    while (pos > 0)
+    {
+        std::size_t parent = (pos - 1) / 4;
+        if (items_[parent].first <= item.first)
+        {
+            break;
+        }
+        place(pos, items_[parent]);
+        pos = parent;
+    }
+    place(pos, item);
+}
+
+void Datastructures::Town_heap::sift_down(std::size_t pos)
+{
+    auto item = items_[pos];
+    std::size_t size = items_.size();
+    while (true)
     {
-        // Top element. Get and pop.
-        current_node = town_queue.front();
-        town_queue.pop();
-        for (auto& road_to : current_node->roads_to)
+        // Find smallest of the (at most) four children.
+        std::size_t first_child = 4 * pos + 1;
+        if (first_child >= size)
+        {
+            break;
+        }
+        std::size_t smallest = first_child;
+        std::size_t last_child = std::min(first_child + 4, size);
+        for (std::size_t child = first_child + 1; child < last_child; ++child)
         {
-            // Check if visited or not.
-            if (road_to->colour == WHITE)
+            if (items_[child].first < items_[smallest].first)
             {
-                // Mark visited and update pi
-                road_to->colour = GRAY;
-                road_to->pi = current_node;
-                town_queue.push(road_to);
+                smallest = child;
             }
         }
-        current_node->colour = BLACK;
+        if (item.first <= items_[smallest].first)
+        {
+            break;
+        }
+        place(pos, items_[smallest]);
+        pos = smallest;
     }
-    // End node not reached. Cant find a route.
-    if (town2_node->second.colour == WHITE)
+    place(pos, item);
+}
+
+void Datastructures::Town_heap::place(std::size_t pos, std::pair<Heap_key, TownHandle> item)
+{
+    items_[pos] = item;
+    ws_.heap_position(item.second) = pos;
+}
+
+Length Datastructures::get_road_length(TownHandle town1, TownHandle town2)
+{
+    // Get coordinate differences of towns as 64-bit values.
+    long long dx = static_cast<long long>(coords_[town1].x) - coords_[town2].x;
+    long long dy = static_cast<long long>(coords_[town1].y) - coords_[town2].y;
+
+    // Now calculate road length.
+    return static_cast<Length>(std::sqrt(static_cast<double>(dx*dx + dy*dy)));
+}
+
+std::shared_ptr<const Datastructures::Road_graph> Datastructures::road_graph()
+{
+    std::lock_guard<std::mutex> lock(road_graph_mutex_);
+    if (road_graph_)
     {
-        return {};
+        return road_graph_;
     }
 
-    // Loop through pi pointers until we get to starting point.
-    Town_info* current = &town2_node->second;
-    while (current != nullptr)
+    // Build CSR arrays from adjacency lists, keeping the order of roads.
+    auto graph = std::make_shared<Road_graph>();
+    graph->offsets.reserve(roads_to_.size() + 1);
+    graph->targets.reserve(2 * roads_.size());
+    graph->lengths.reserve(2 * roads_.size());
+    graph->offsets.push_back(0);
+    graph->version = road_version_;
+    for (TownHandle town = 0; town < roads_to_.size(); ++town)
     {
-        // Add them to final route
-        route.push_back(current->id);
-        current = current->pi;
+        for (Road_to const& road : roads_to_[town])
+        {
+            graph->targets.push_back(road.town);
+            graph->lengths.push_back(road.length);
+            // Lengths are rounded down, so ratio can be below 1.
+            if (road.length > 0)
+            {
+                double dx = static_cast<double>(coords_[town].x) - coords_[road.town].x;
+                double dy = static_cast<double>(coords_[town].y) - coords_[road.town].y;
+                graph->length_ratio = std::min(graph->length_ratio, road.length / std::sqrt(dx*dx + dy*dy));
+            }
+        }
+        graph->offsets.push_back(graph->targets.size());
     }
-    // Reverse route.
-    std::reverse(route.begin(), route.end());
-    return route;
+    // Leave room for rounding errors of estimates (see min_est).
+    graph->length_ratio *= 1 - 1e-4;
+    road_graph_ = std::move(graph);
+    return road_graph_;
 }
 
-std::vector<TownID> Datastructures::road_cycle_route(TownID startid)
+void Datastructures::invalidate_road_graph()
 {
-    // Get first node.
-    auto start_node = towns_by_id_.find(startid);
-    if (start_node == towns_by_id_.end())
-    {
-        return {NO_TOWNID};
-    }
+    std::lock_guard<std::mutex> lock(road_graph_mutex_);
+    road_graph_ = nullptr;
+    contraction_hierarchy_ = nullptr;
+    ++road_version_;
+}
 
-    // Initialize all towns.
-    for (auto& town : towns_by_id_)
+void Datastructures::prepare_routing()
+{
+    std::shared_ptr<Road_graph const> graph = road_graph();
+    std::shared_ptr<Contraction_hierarchy const> hierarchy = contract_road_graph(*graph);
+    std::lock_guard<std::mutex> lock(road_graph_mutex_);
+    // Hierarchy is only valid for the snapshot it was built from.
+    if (road_graph_ == graph)
     {
-        town.second.colour = WHITE;
-        town.second.pi = nullptr;
+        contraction_hierarchy_ = std::move(hierarchy);
     }
+}
 
-    // Storing cycle information.
-    std::vector<Town_info*> cycle_road;
-    std::vector<TownID> cycle_id;
-    Town_info* current;
-
-    // Stack for road processing.
-    std::stack<Town_info*> road_stack = {};
-    bool cycle_found = false;
-    // Push first to stack
-    road_stack.push(&start_node->second);
-    Town_info* loop_node = nullptr;
-    std::vector<Town_info*> test;
+std::shared_ptr<const Datastructures::Contraction_hierarchy> Datastructures::contraction_hierarchy()
+{
+    std::lock_guard<std::mutex> lock(road_graph_mutex_);
+    return contraction_hierarchy_;
+}
 
-    // Now we can start the DFS
-    while (!road_stack.empty())
+std::uint32_t Datastructures::Contraction_hierarchy::find_edge(TownHandle town1, TownHandle town2) const
+{
+    // Edge is upward from the town that was contracted first.
+    for (std::uint32_t edge = begin(town1); edge < end(town1); ++edge)
     {
-        if (cycle_found == true)
+        if (targets[edge] == town2)
         {
-            break;
+            return edge;
         }
-        // Top of the stack.
-        current = road_stack.top();
-        road_stack.pop();
-        // Push back elements to different vector.
-        cycle_road.push_back(current);
+    }
+    for (std::uint32_t edge = begin(town2); edge < end(town2); ++edge)
+    {
+        if (targets[edge] == town1)
+        {
+            return edge;
+        }
+    }
+    return NO_ROAD;
+}
 
-        if (current->colour == WHITE)
+std::shared_ptr<const Datastructures::Contraction_hierarchy> Datastructures::contract_road_graph(Road_graph const& graph)
+{
+    // Witness searches give up after settling this many towns or going this
+    // many roads deep. Missing a witness only adds an unnecessary shortcut,
+    // but those pile up in dense parts of the graph, so searches done for
+    // contraction go far. Priority is only an estimate, found with a cheaper
+    // search.
+    struct Witness_limits
+    {
+        unsigned int settled;
+        unsigned int hops;
+    };
+    Witness_limits const contraction_limits = {1000, 10};
+    Witness_limits const priority_limits = {100, 3};
+    // Updating priority takes a witness search per arc, so neighbours with
+    // more arcs than this are only updated when they come up in the queue.
+    std::size_t const neighbour_update_arcs = 8;
+
+    // Remaining graph: arcs of each town to towns not contracted yet.
+    struct Arc
+    {
+        TownHandle town;
+        Length length;
+        TownHandle middle;
+    };
+    std::size_t const town_count = graph.offsets.empty() ? 0 : graph.offsets.size() - 1;
+    std::vector<std::vector<Arc>> arcs(town_count);
+    for (TownHandle town = 0; town < town_count; ++town)
+    {
+        for (auto road = graph.begin(town); road < graph.end(town); ++road)
         {
-            road_stack.push(current);
-            current->colour = GRAY;
-            // Go through roads of a town.
-            for (auto& road_to_town : current->roads_to)
+            arcs[town].push_back({graph.targets[road], graph.lengths[road], NO_HANDLE});
+        }
+    }
+    std::vector<std::vector<Arc>> upward(town_count);
+    std::vector<int> contracted_neighbours(town_count, 0);
+
+    // Dijkstra from source in remaining graph without town. Target is done
+    // once it is reached within its target length, and search stops when all
+    // targets are done. Towns farther than max_length are not queued.
+    using Queue_item = std::pair<Length, TownHandle>;
+    std::vector<Length> distances(town_count, NO_LENGTH);
+    std::vector<unsigned int> hops(town_count, 0);
+    std::vector<Length> target_lengths(town_count, -1);
+    std::vector<TownHandle> reached;
+    std::vector<Queue_item> queue;
+    auto witness_search = [&](TownHandle source, TownHandle without, Length max_length, std::size_t targets,
+                              Witness_limits limits)
+    {
+        for (TownHandle town : reached)
+        {
+            distances[town] = NO_LENGTH;
+        }
+        reached = {source};
+        queue = {{0, source}};
+        distances[source] = 0;
+        hops[source] = 0;
+        for (unsigned int settled = 0; !queue.empty() && settled < limits.settled; ++settled)
+        {
+            std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+            Queue_item item = queue.back();
+            queue.pop_back();
+            if (item.first > distances[item.second] || hops[item.second] == limits.hops)
             {
-                // Is town visited?
-                if (road_to_town->colour == WHITE)
+                continue;
+            }
+            for (Arc const& arc : arcs[item.second])
+            {
+                Length length = item.first + arc.length;
+                if (arc.town == without || length >= distances[arc.town] || length > max_length)
                 {
-                    road_to_town->pi = current;
-                    road_stack.push(road_to_town);
+                    continue;
                 }
-                // Continue if last town.
-                if (road_to_town == current->pi)
+                if (distances[arc.town] == NO_LENGTH)
                 {
-                    continue;
+                    reached.push_back(arc.town);
                 }
-                // We are in the "loop"
-                else if (road_to_town->colour == GRAY)
+                distances[arc.town] = length;
+                hops[arc.town] = hops[item.second] + 1;
+                if (length <= target_lengths[arc.town])
                 {
-                    // But only depends on current pi.
-                    if (road_to_town->pi == current)
+                    target_lengths[arc.town] = -1;
+                    if (--targets == 0)
                     {
-                        continue;
+                        return;
                     }
-                    // Adding elements and breaking out.
-                    loop_node = road_to_town;
-                    cycle_road.push_back(road_to_town);
-                    cycle_id.push_back(loop_node->id);
-                    cycle_found = true;
-                    break;
                 }
+                queue.push_back({length, arc.town});
+                std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
             }
         }
-        else
+    };
+
+    // Adds arc or shortens existing one.
+    auto add_arc = [&](TownHandle from, TownHandle to, Length length, TownHandle middle)
+    {
+        for (Arc& arc : arcs[from])
         {
-            cycle_road.pop_back();
-            current->colour = BLACK;
+            if (arc.town == to)
+            {
+                if (length < arc.length)
+                {
+                    arc = {to, length, middle};
+                }
+                return;
+            }
         }
-    }
+        arcs[from].push_back({to, length, middle});
+    };
+
+    // Shortcuts needed between neighbours of town if it was contracted.
+    struct Shortcut
+    {
+        TownHandle from;
+        TownHandle to;
+        Length length;
+    };
+    std::vector<Shortcut> shortcuts;
+    auto find_shortcuts = [&](TownHandle town, Witness_limits limits)
+    {
+        shortcuts.clear();
+        auto const& neighbours = arcs[town];
+        for (std::size_t i = 0; i + 1 < neighbours.size(); ++i)
+        {
+            Arc const& from = neighbours[i];
+            Length max_length = 0;
+            for (std::size_t j = i + 1; j < neighbours.size(); ++j)
+            {
+                target_lengths[neighbours[j].town] = from.length + neighbours[j].length;
+                max_length = std::max(max_length, target_lengths[neighbours[j].town]);
+            }
+            witness_search(from.town, town, max_length, neighbours.size() - i - 1, limits);
+            for (std::size_t j = i + 1; j < neighbours.size(); ++j)
+            {
+                Arc const& to = neighbours[j];
+                target_lengths[to.town] = -1;
+                Length length = from.length + to.length;
+                if (distances[to.town] > length)
+                {
+                    shortcuts.push_back({from.town, to.town, length});
+                }
+            }
+        }
+    };
 
-    // If cycle is not found, then return empty.
-    if (cycle_found == false)
+    // Edge difference plus contracted neighbours spreads contraction evenly.
+    auto priority = [&](TownHandle town)
     {
-        return {};
-    }
+        find_shortcuts(town, priority_limits);
+        return static_cast<int>(shortcuts.size()) - static_cast<int>(arcs[town].size()) + contracted_neighbours[town];
+    };
 
-    // Get the loop route.
-    Town_info* loop_elem = cycle_road.at(cycle_road.size() - 2);
-    while (loop_elem != nullptr)
+    // Queue has an entry for each priority a town has had. Only the entry with
+    // current priority of a town not contracted yet is used.
+    std::vector<int> priorities(town_count);
+    std::vector<bool> is_contracted(town_count, false);
+    std::priority_queue<Queue_item, std::vector<Queue_item>, std::greater<Queue_item>> order;
+    for (TownHandle town = 0; town < town_count; ++town)
     {
-        cycle_id.push_back(loop_elem->id);
-        loop_elem = loop_elem->pi;
+        priorities[town] = priority(town);
+        order.push({priorities[town], town});
     }
-    std::reverse(cycle_id.begin(), cycle_id.end());
-    return cycle_id;
-
-}
-
-
-std::vector<TownID> Datastructures::shortest_route(TownID fromid, TownID toid)
-{
-    // Get start node and last node.
-    auto start_node = towns_by_id_.find(fromid);
-    auto last_node = towns_by_id_.find(toid);
-
-    // Check if start node and last node are found.
-    if (start_node == towns_by_id_.end())
+    while (!order.empty())
     {
-        return {NO_TOWNID};
+        Queue_item item = order.top();
+        order.pop();
+        TownHandle town = item.second;
+        if (is_contracted[town] || item.first != priorities[town])
+        {
+            continue;
+        }
+        // Lazy update: contract town only if it is still least important.
+        priorities[town] = priority(town);
+        if (!order.empty() && priorities[town] > order.top().first)
+        {
+            order.push({priorities[town], town});
+            continue;
+        }
+        is_contracted[town] = true;
+        find_shortcuts(town, contraction_limits);
+        for (Shortcut const& shortcut : shortcuts)
+        {
+            add_arc(shortcut.from, shortcut.to, shortcut.length, town);
+            add_arc(shortcut.to, shortcut.from, shortcut.length, town);
+        }
+        // Remaining arcs of town go up in the hierarchy.
+        for (Arc const& arc : arcs[town])
+        {
+            auto& other = arcs[arc.town];
+            auto back = std::find_if(other.begin(), other.end(), [town](Arc const& a){ return a.town == town; });
+            *back = other.back();
+            other.pop_back();
+            ++contracted_neighbours[arc.town];
+        }
+        upward[town] = std::move(arcs[town]);
+        arcs[town] = {};
+        // Neighbours lost an arc and may have got shortcuts.
+        for (Arc const& arc : upward[town])
+        {
+            if (arcs[arc.town].size() <= neighbour_update_arcs)
+            {
+                priorities[arc.town] = priority(arc.town);
+                order.push({priorities[arc.town], arc.town});
+            }
+        }
     }
-    if (last_node == towns_by_id_.end())
+
+    // Upward edges to CSR arrays.
+    auto hierarchy = std::make_shared<Contraction_hierarchy>();
+    hierarchy->offsets.reserve(town_count + 1);
+    hierarchy->offsets.push_back(0);
+    for (auto const& edges : upward)
     {
-        return {NO_TOWNID};
+        for (Arc const& arc : edges)
+        {
+            hierarchy->targets.push_back(arc.town);
+            hierarchy->lengths.push_back(arc.length);
+            hierarchy->middles.push_back(arc.middle);
+        }
+        hierarchy->offsets.push_back(hierarchy->targets.size());
     }
+    return hierarchy;
+}
 
-    // Initialize variables.
-    for (auto& town : towns_by_id_)
+bool Datastructures::is_stalled(Route_workspace& ws, Contraction_hierarchy const& hierarchy, TownHandle town,
+                                Length length, bool is_forward)
+{
+    // Roads are two-way, so upward edge of town is also a downward edge from
+    // the more important town to it.
+    for (std::uint32_t edge = hierarchy.begin(town); edge < hierarchy.end(town); ++edge)
     {
-        town.second.colour = WHITE;
-        town.second.pi = nullptr;
-        town.second.cost.d = INT_MAX;
-        town.second.cost.de = INT_MAX;
+        Cost const& cost = ws.cost(hierarchy.targets[edge]);
+        Length other = is_forward ? cost.d : cost.de;
+        if (other != NO_LENGTH && other + hierarchy.lengths[edge] < length)
+        {
+            return true;
+        }
     }
-    // Final route.
-    std::vector<TownID> route = {};
-    // Bool to check if node is found.
-    bool node_found = false;
-    // Priority queue for A* algorithm.
-    std::priority_queue<std::pair<int, Town_info*>> town_queue;
-    // Start from the start node. Mark it gray and distance to 0.
-    start_node->second.colour = GRAY;
-    start_node->second.cost.d = 0;
-    // Push starting town to the priority queue.
-    town_queue.push({start_node->second.cost.d, &start_node->second});
-    // For the current pair in queue.
-    std::pair<int, Town_info*> current;
-    while (!town_queue.empty())
-    {
-        // Get cheapest road from priority queue.
-        current = town_queue.top();
-        town_queue.pop();
-        if (current.second->colour == BLACK)
+    return false;
+}
+
+bool Datastructures::hierarchy_route(Route_workspace& ws, Contraction_hierarchy const& hierarchy,
+                                     TownHandle start, TownHandle goal, std::vector<TownHandle>& route)
+{
+    // Forward search uses cost d and pi, backward search cost de and next.
+    using Queue_item = std::pair<Length, TownHandle>;
+    auto& forward = ws.forward_queue;
+    auto& backward = ws.backward_queue;
+    forward = {{0, start}};
+    backward = {{0, goal}};
+    ws.cost(start).d = 0;
+    ws.cost(goal).de = 0;
+
+    Length best = NO_LENGTH;
+    TownHandle meet = NO_HANDLE;
+    while (!forward.empty() || !backward.empty())
+    {
+        Length forward_min = forward.empty() ? NO_LENGTH : forward.front().first;
+        Length backward_min = backward.empty() ? NO_LENGTH : backward.front().first;
+        // Neither search can find a shorter route anymore.
+        if (std::min(forward_min, backward_min) >= best)
+        {
+            break;
+        }
+        bool is_forward = forward_min <= backward_min;
+        auto& queue = is_forward ? forward : backward;
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+        Queue_item item = queue.back();
+        queue.pop_back();
+        Cost const& cost = ws.cost(item.second);
+        if (item.first > (is_forward ? cost.d : cost.de))
         {
-            // Skip if BLACK. No need to process.
             continue;
         }
-        // If end node was found, quit.
-        if (current.second->id == toid)
+        // Searches meet at town reached from both sides.
+        Length other = is_forward ? cost.de : cost.d;
+        if (other != NO_LENGTH && item.first + other < best)
         {
-            node_found = true;
-            break;
+            best = item.first + other;
+            meet = item.second;
         }
-        // Go through roads of town.
-        for (auto& road_to_town : current.second->roads_to)
+        if (is_stalled(ws, hierarchy, item.second, item.first, is_forward))
         {
-            // Make a new estimate.
-            relax_A(current.second, road_to_town, &last_node->second);
-            // If node is new, add to priority queue.
-            if (road_to_town->colour == WHITE)
-            {
-                road_to_town->colour = GRAY;
-                // Negative because c++ priority queue takes biggest value.
-                town_queue.push({-(road_to_town->cost.de), road_to_town});
-            }
-            else
+            continue;
+        }
+        for (std::uint32_t edge = hierarchy.begin(item.second); edge < hierarchy.end(item.second); ++edge)
+        {
+            TownHandle town = hierarchy.targets[edge];
+            Length length = item.first + hierarchy.lengths[edge];
+            Length& old_length = is_forward ? ws.cost(town).d : ws.cost(town).de;
+            if (length < old_length)
             {
-                // Old node, we push it back to queue.
-                town_queue.push({-(road_to_town->cost.de), road_to_town});
+                old_length = length;
+                (is_forward ? ws.pi(town) : ws.next(town)) = item.second;
+                queue.push_back({length, town});
+                std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
             }
         }
-        current.second->colour = BLACK;
     }
-
-    Town_info* route_iter = &last_node->second;
-    while (route_iter != nullptr)
+    if (meet == NO_HANDLE)
     {
-        route.push_back(route_iter->id);
-        route_iter = route_iter->pi;
+        return false;
     }
 
-    if (node_found == false)
+    // Hierarchy edges from start up to meeting town and down to goal.
+    std::vector<TownHandle> hops;
+    for (TownHandle town = meet; town != NO_HANDLE; town = ws.pi(town))
     {
-        return {};
+        hops.push_back(town);
+    }
+    std::reverse(hops.begin(), hops.end());
+    for (TownHandle town = ws.next(meet); town != NO_HANDLE; town = ws.next(town))
+    {
+        hops.push_back(town);
     }
-    std::reverse(route.begin(), route.end());
-    return route;
-}
 
-Distance Datastructures::trim_road_network()
-{
-    // Replace the line below with your implementation
-    throw NotImplemented("trim_road_network()");
+    // Unpack shortcuts into roads, first half of each shortcut first.
+    route = {start};
+    std::vector<std::pair<TownHandle, TownHandle>> stack;
+    for (std::size_t hop = hops.size(); hop-- > 1;)
+    {
+        stack.push_back({hops[hop - 1], hops[hop]});
+    }
+    while (!stack.empty())
+    {
+        std::pair<TownHandle, TownHandle> edge = stack.back();
+        stack.pop_back();
+        TownHandle middle = hierarchy.middles[hierarchy.find_edge(edge.first, edge.second)];
+        if (middle == NO_HANDLE)
+        {
+            route.push_back(edge.second);
+            continue;
+        }
+        stack.push_back({middle, edge.second});
+        stack.push_back({edge.first, middle});
+    }
+    return true;
+}
+
+bool Datastructures::relax_A(Route_workspace& ws, Road_graph const& graph, TownHandle u, TownHandle v, Length length, TownHandle g)
+{
+    // Calculate new cost estimates for A* algorithm.
+    // updates pi handles if better route is found. Also updates
+    // distance estimates. Routes are compared by length and then by
+    // roads, and of equal routes the one from smaller handle is kept, so
+    // that the route doesn't depend on search order (see build_route_tree).
+    Length d = ws.cost(u).d + length;
+    std::uint32_t roads = ws.cost(u).roads + 1;
+    Cost& cost = ws.cost(v);
+    if (std::make_pair(d, roads) < std::make_pair(cost.d, cost.roads))
+    {
+        cost.d = d;
+        cost.de = (d + min_est(graph, v, g));
+        cost.roads = roads;
+        ws.pi(v) = u;
+        return true;
+    }
+    if (d == cost.d && roads == cost.roads && u < ws.pi(v))
+    {
+        ws.pi(v) = u;
+    }
+    return false;
+}
+
+bool Datastructures::a_star(Route_workspace& ws, Road_graph const& graph, TownHandle start, TownHandle goal)
+{
+    // Priority queue for A* algorithm, keyed on distance estimate.
+    Town_heap town_queue(ws);
+    // Start from the start node. Mark it gray and distance to 0.
+    ws.colour(start) = GRAY;
+    ws.cost(start) = {0, min_est(graph, start, goal), 0};
+    town_queue.push_or_decrease(start, {ws.cost(start).de, 0});
+    while (!town_queue.empty())
+    {
+        // Get cheapest town from priority queue.
+        TownHandle current = town_queue.pop();
+        // If end node was found, quit.
+        if (current == goal)
+        {
+            return true;
+        }
+        ws.colour(current) = BLACK;
+        // Go through roads of town. Settled towns are not processed again.
+        for (auto road = graph.begin(current); road < graph.end(current); ++road)
+        {
+            TownHandle road_to_town = graph.targets[road];
+            if (ws.colour(road_to_town) != BLACK &&
+                relax_A(ws, graph, current, road_to_town, graph.lengths[road], goal))
+            {
+                ws.colour(road_to_town) = GRAY;
+                town_queue.push_or_decrease(road_to_town, {ws.cost(road_to_town).de, ws.cost(road_to_town).roads});
+            }
+        }
+    }
+    return false;
+}
+
+Length Datastructures::min_est(Road_graph const& graph, TownHandle v, TownHandle g)
+{
+    // Calculates minimum estimate for road length. Calculation is made
+    // by using straight line from current town v to goal town g. Rounded
+    // road lengths can be shorter than straight line, so it is scaled by
+    // length ratio of roads. Ratio is a bit smaller than the real one, which
+    // keeps rounding errors from making the estimate drop more than a road.
+    double dx = static_cast<double>(coords_[v].x) - coords_[g].x;
+    double dy = static_cast<double>(coords_[v].y) - coords_[g].y;
+    Length estimate = static_cast<Length>(graph.length_ratio * std::sqrt(dx*dx + dy*dy));
+
+    // Road distance from v to g is at least |d(l,g) - d(l,v)| for each
+    // landmark l that reaches both.
+    std::size_t count = landmarks_.towns.size();
+    if (count == 0 || std::max(v, g) >= landmarks_.distances.size() / count)
+    {
+        return estimate;
+    }
+    Length const* v_distances = &landmarks_.distances[v * count];
+    Length const* g_distances = &landmarks_.distances[g * count];
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (v_distances[i] != NO_LENGTH && g_distances[i] != NO_LENGTH)
+        {
+            estimate = std::max(estimate, std::abs(v_distances[i] - g_distances[i]));
+        }
+    }
+    return estimate;
+}
+
+void Datastructures::prepare_landmarks(unsigned int count)
+{
+    landmarks_ = {};
+    landmarks_.count = count;
+    build_landmarks();
+}
+
+void Datastructures::landmark_distances(Road_graph const& graph, TownHandle landmark, std::vector<Length>& distances)
+{
+    using Queue_item = std::pair<Length, TownHandle>;
+    std::vector<Queue_item> queue = {{0, landmark}};
+    distances[landmark] = 0;
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+        Queue_item item = queue.back();
+        queue.pop_back();
+        if (item.first > distances[item.second])
+        {
+            continue;
+        }
+        for (auto road = graph.begin(item.second); road < graph.end(item.second); ++road)
+        {
+            Length length = item.first + graph.lengths[road];
+            if (length < distances[graph.targets[road]])
+            {
+                distances[graph.targets[road]] = length;
+                queue.push_back({length, graph.targets[road]});
+                std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+            }
+        }
+    }
+}
+
+void Datastructures::build_landmarks()
+{
+    landmarks_dirty_ = false;
+    landmarks_.towns = {};
+    landmarks_.distances = {};
+
+    // Farthest point selection: first landmark is the town farthest from
+    // some town, each next one the town farthest from chosen landmarks.
+    std::vector<long long> nearest_landmark(ids_.size(), std::numeric_limits<long long>::max());
+    TownHandle next = NO_HANDLE;
+    for (TownHandle town = 0; town < ids_.size() && next == NO_HANDLE; ++town)
+    {
+        next = alive_[town] ? town : NO_HANDLE;
+    }
+    for (unsigned int i = 0; i <= landmarks_.count && next != NO_HANDLE; ++i)
+    {
+        if (i > 0)
+        {
+            landmarks_.towns.push_back(next);
+        }
+        Coord coord = coords_[next];
+        long long farthest = 0;
+        next = NO_HANDLE;
+        for (TownHandle town = 0; town < ids_.size(); ++town)
+        {
+            if (!alive_[town])
+            {
+                continue;
+            }
+            long long distance = squared_distance(coords_[town], coord);
+            nearest_landmark[town] = i > 0 ? std::min(nearest_landmark[town], distance) : distance;
+            if (nearest_landmark[town] > farthest)
+            {
+                farthest = nearest_landmark[town];
+                next = town;
+            }
+        }
+    }
+
+    // Dijkstra from each landmark in parallel, then interleave tables so
+    // that distances of a town are next to each other.
+    std::size_t count = landmarks_.towns.size();
+    if (count == 0)
+    {
+        return;
+    }
+    std::shared_ptr<Road_graph const> graph = road_graph();
+    std::vector<std::vector<Length>> tables(count);
+    parallel_ranges(count, 1, [&](std::size_t first, std::size_t last)
+    {
+        for (std::size_t i = first; i < last; ++i)
+        {
+            tables[i].assign(ids_.size(), NO_LENGTH);
+            landmark_distances(*graph, landmarks_.towns[i], tables[i]);
+        }
+    });
+    landmarks_.distances.resize(ids_.size() * count);
+    for (TownHandle town = 0; town < ids_.size(); ++town)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            landmarks_.distances[town * count + i] = tables[i][town];
+        }
+    }
+}
+
+void Datastructures::add_landmark_road(TownHandle town1, TownHandle town2, Length length)
+{
+    std::size_t count = landmarks_.towns.size();
+    if (count == 0 || landmarks_dirty_)
+    {
+        return;
+    }
+    // Towns added after tables were computed are unreachable so far.
+    landmarks_.distances.resize(ids_.size() * count, NO_LENGTH);
+
+    // Distances only get shorter. Dijkstra from the end of the road that got
+    // closer goes only through towns whose distance changes.
+    using Queue_item = std::pair<Length, TownHandle>;
+    std::vector<Queue_item> queue;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto distance = [&](TownHandle town) -> Length& { return landmarks_.distances[town * count + i]; };
+        for (auto [from, to] : {std::make_pair(town1, town2), std::make_pair(town2, town1)})
+        {
+            if (distance(from) != NO_LENGTH && distance(from) + length < distance(to))
+            {
+                distance(to) = distance(from) + length;
+                queue.push_back({distance(to), to});
+            }
+        }
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+            Queue_item item = queue.back();
+            queue.pop_back();
+            if (item.first > distance(item.second))
+            {
+                continue;
+            }
+            for (Road_to const& road : roads_to_[item.second])
+            {
+                if (item.first + road.length < distance(road.town))
+                {
+                    distance(road.town) = item.first + road.length;
+                    queue.push_back({distance(road.town), road.town});
+                    std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+                }
+            }
+        }
+    }
+}
+
+void Datastructures::refresh_landmarks()
+{
+    std::lock_guard<std::mutex> lock(landmarks_mutex_);
+    if (landmarks_dirty_)
+    {
+        build_landmarks();
+    }
+}
+
+void Datastructures::clear_roads()
+{
+    // Goes through all the towns and empties their roads.
+    for (auto& roads_to : roads_to_)
+    {
+        roads_to = {};
+    }
+    // Empty other data structures.
+    roads_ = {};
+    road_infos_ = {};
+    road_index_ = {};
+    invalidate_road_graph();
+    landmarks_dirty_ = true;
+
+    // Every town is its own component again.
+    components_ = {};
+    for (TownHandle town = 0; town < ids_.size(); ++town)
+    {
+        add_component(town);
+    }
+}
+
+std::vector<std::pair<TownID, TownID>> Datastructures::all_roads()
+{
+    // Get roads from different data structure.
+    return roads_;
+}
+
+std::vector<std::pair<TownID, TownID>> const& Datastructures::all_roads_view() const
+{
+    return roads_;
+}
+
+bool Datastructures::add_road(TownID town1, TownID town2)
+{
+    // Find if town1 exists.
+    TownHandle town1_node = find_handle(town1);
+    if (town1_node == NO_HANDLE)
+    {
+        return false;
+    }
+    // Find if town2 exists.
+    TownHandle town2_node = find_handle(town2);
+    if (town2_node == NO_HANDLE)
+    {
+        return false;
+    }
+    // Check if adding road to town itself. This is not wanted.
+    if (town1_node == town2_node)
+    {
+        return false;
+    }
+    // Lastly we have to check if road already exists. If it does, we don't add.
+    std::uint32_t road = roads_.size();
+    if (!road_index_.insert({road_key(town1_node, town2_node), road}).second)
+    {
+        return false;
+    }
+
+    // Add roads to both ways. Road length is calculated only here.
+    Length length = get_road_length(town1_node, town2_node);
+    road_infos_.push_back({town1_node, town2_node,
+                           static_cast<std::uint32_t>(roads_to_[town1_node].size()),
+                           static_cast<std::uint32_t>(roads_to_[town2_node].size())});
+    roads_to_[town1_node].push_back({town2_node, length, road});
+    roads_to_[town2_node].push_back({town1_node, length, road});
+
+    // Add to different data structure, smaller ID first.
+    if (town1 < town2)
+    {
+        roads_.push_back({std::move(town1), std::move(town2)});
+    }
+    else
+    {
+        roads_.push_back({std::move(town2), std::move(town1)});
+    }
+    invalidate_road_graph();
+    join_components(town1_node, town2_node);
+    add_landmark_road(town1_node, town2_node, length);
+
+    return true;
+}
+
+std::vector<TownID> Datastructures::get_roads_from(TownID id)
+{
+    // Get if town is found.
+    TownHandle town_node = find_handle(id);
+    if (town_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+    // Now we go through the roads!
+    std::vector<TownID> all_of_roads = {};
+
+    // Reserve for roads.
+    all_of_roads.reserve(roads_to_[town_node].size());
+
+    // Go through roads.
+    for (Road_to const& road : roads_to_[town_node])
+    {
+        all_of_roads.push_back(ids_[road.town]);
+    }
+    return all_of_roads;
+}
+
+Datastructures::Roads_from_view Datastructures::get_roads_from_view(TownID id) const
+{
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
+    {
+        return {this, nullptr, nullptr};
+    }
+    auto const& roads_to = roads_to_[town];
+    return {this, roads_to.data(), roads_to.data() + roads_to.size()};
+}
+
+bool Datastructures::get_roads_from(TownID id, std::vector<TownID>& towns) const
+{
+    TownHandle town = find_handle(id);
+    if (town == NO_HANDLE)
+    {
+        towns.clear();
+        return false;
+    }
+    auto const& roads_to = roads_to_[town];
+    Roads_from_view view(this, roads_to.data(), roads_to.data() + roads_to.size());
+    towns.assign(view.begin(), view.end());
+    return true;
+}
+
+std::vector<TownID> Datastructures::any_route(TownID fromid, TownID toid)
+{
+    return least_towns_route(fromid, toid);
+}
+
+bool Datastructures::remove_road(TownID town1, TownID town2)
+{
+    // Check if towns exist.
+    TownHandle town1_node = find_handle(town1);
+    if (town1_node == NO_HANDLE)
+    {
+        return false;
+    }
+    // Find if town2 exists.
+    TownHandle town2_node = find_handle(town2);
+    if (town2_node == NO_HANDLE)
+    {
+        return false;
+    }
+
+    // Find if road exists.
+    auto road_pair = road_index_.find(road_key(town1_node, town2_node));
+    if (road_pair == road_index_.end())
+    {
+        return false;
+    }
+    erase_road(road_pair->second);
+    invalidate_road_graph();
+    mark_component_dirty(town1_node);
+    landmarks_dirty_ = true;
+
+    return true;
+}
+
+void Datastructures::erase_road(std::uint32_t road)
+{
+    // Remove road from road index and adjacency lists of both towns.
+    Road_info info = road_infos_[road];
+    road_index_.erase(road_key(info.town1, info.town2));
+    remove_road_slot(info.town1, info.slot1);
+    remove_road_slot(info.town2, info.slot2);
+
+    // Move last road of road list to its place.
+    std::uint32_t last = roads_.size() - 1;
+    if (road != last)
+    {
+        Road_info const& moved = road_infos_[last];
+        roads_to_[moved.town1][moved.slot1].road = road;
+        roads_to_[moved.town2][moved.slot2].road = road;
+        road_index_[road_key(moved.town1, moved.town2)] = road;
+        roads_[road] = std::move(roads_[last]);
+        road_infos_[road] = moved;
+    }
+    roads_.pop_back();
+    road_infos_.pop_back();
+}
+
+std::uint64_t Datastructures::road_key(TownHandle town1, TownHandle town2)
+{
+    // Smaller handle to high bits, so that key doesn't depend on direction.
+    return (std::uint64_t{std::min(town1, town2)} << 32) | std::max(town1, town2);
+}
+
+std::uint32_t Datastructures::find_road(TownHandle town1, TownHandle town2) const
+{
+    auto road = road_index_.find(road_key(town1, town2));
+    if (road == road_index_.end())
+    {
+        return NO_ROAD;
+    }
+    return road->second;
+}
+
+void Datastructures::remove_road_slot(TownHandle town, std::uint32_t slot)
+{
+    auto& roads_to = roads_to_[town];
+    if (slot + 1 != roads_to.size())
+    {
+        // Move last road to the slot and tell the road about its new position.
+        roads_to[slot] = roads_to.back();
+        Road_info& moved = road_infos_[roads_to[slot].road];
+        if (moved.town1 == town)
+        {
+            moved.slot1 = slot;
+        }
+        else
+        {
+            moved.slot2 = slot;
+        }
+    }
+    roads_to.pop_back();
+}
+
+std::vector<TownID> Datastructures::least_towns_route(TownID fromid, TownID toid)
+{
+    // Check if towns exist.
+    TownHandle town1_node = find_handle(fromid);
+    TownHandle town2_node = find_handle(toid);
+
+    if (town1_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+    if (town2_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+
+    // Route to town itself.
+    if (town1_node == town2_node)
+    {
+        return {fromid};
+    }
+
+    // No route between different components.
+    if (!towns_connected(town1_node, town2_node))
+    {
+        return {};
+    }
+
+    // Repeated queries from the same town walk its route tree.
+    if (std::shared_ptr<Route_tree const> tree = route_tree(town1_node, LEAST_TOWNS_ROUTE))
+    {
+        return tree_route(*tree, town2_node);
+    }
+
+    // Road graph snapshot and this thread's workspace for the query.
+    std::shared_ptr<Road_graph const> graph = road_graph();
+    Route_workspace& ws = route_workspace();
+    ws.begin(ids_.size());
+
+    // Frontiers of the searches from both ends. Towns get number of roads
+    // from start as cost d on start side, and from end as de on end side.
+    std::vector<TownHandle> from_frontier = {town1_node};
+    std::vector<TownHandle> to_frontier = {town2_node};
+    std::vector<TownHandle> next_frontier;
+    ws.side(town1_node) = FROM_SIDE;
+    ws.cost(town1_node).d = 0;
+    ws.side(town2_node) = TO_SIDE;
+    ws.cost(town2_node).de = 0;
+    Length from_level = 0;
+    Length to_level = 0;
+    bool met = false;
+
+    while (!met && !from_frontier.empty() && !to_frontier.empty())
+    {
+        // Expand whole level of the side with smaller frontier.
+        bool expand_from = from_frontier.size() <= to_frontier.size();
+        auto& frontier = expand_from ? from_frontier : to_frontier;
+        Length& level = expand_from ? from_level : to_level;
+        std::uint8_t own_side = expand_from ? FROM_SIDE : TO_SIDE;
+
+        next_frontier.clear();
+        for (TownHandle current_node : frontier)
+        {
+            for (auto road = graph->begin(current_node); road < graph->end(current_node); ++road)
+            {
+                TownHandle road_to = graph->targets[road];
+                std::uint8_t& side = ws.side(road_to);
+                if (side == own_side)
+                {
+                    continue;
+                }
+                // Other search has been here: route found.
+                if (side != 0)
+                {
+                    met = true;
+                    break;
+                }
+                // Mark visited and its distance from own end.
+                side = own_side;
+                (expand_from ? ws.cost(road_to).d : ws.cost(road_to).de) = level + 1;
+                next_frontier.push_back(road_to);
+            }
+            if (met)
+            {
+                break;
+            }
+        }
+        // Frontiers are left at their last full levels.
+        if (!met)
+        {
+            frontier.swap(next_frontier);
+            ++level;
+        }
+    }
+    // Searches didn't meet. Cant find a route.
+    if (!met)
+    {
+        return {};
+    }
+
+    // Shortest routes have from_level + to_level + 1 roads. Route is chosen
+    // as in BFS tree from start (see build_route_tree): going back from end,
+    // previous town is the neighbour with smallest handle that is one road
+    // closer to start. End side towns don't know their distance from start,
+    // so it is given to those on shortest routes, going forward from the
+    // meeting levels.
+    Length route_roads = from_level + to_level + 1;
+    std::vector<TownHandle> layer;
+    // First layer is the end side frontier towns next to start side frontier.
+    // Roads are checked from the smaller frontier.
+    bool scan_from = from_frontier.size() <= to_frontier.size();
+    for (TownHandle town : scan_from ? from_frontier : to_frontier)
+    {
+        for (auto road = graph->begin(town); road < graph->end(town); ++road)
+        {
+            TownHandle road_to = graph->targets[road];
+            if (scan_from && ws.side(road_to) == TO_SIDE && ws.cost(road_to).de == to_level)
+            {
+                // Mark now so that it is added only once.
+                ws.side(road_to) |= FROM_SIDE;
+                layer.push_back(road_to);
+            }
+            else if (!scan_from && ws.side(road_to) == FROM_SIDE && ws.cost(road_to).d == from_level)
+            {
+                ws.side(town) |= FROM_SIDE;
+                layer.push_back(town);
+                break;
+            }
+        }
+    }
+    for (Length level = from_level + 1; !layer.empty(); ++level)
+    {
+        next_frontier.clear();
+        for (TownHandle town : layer)
+        {
+            ws.cost(town).d = level;
+            for (auto road = graph->begin(town); road < graph->end(town); ++road)
+            {
+                TownHandle road_to = graph->targets[road];
+                if (ws.side(road_to) == TO_SIDE && ws.cost(road_to).de == route_roads - level - 1)
+                {
+                    ws.side(road_to) |= FROM_SIDE;
+                    next_frontier.push_back(road_to);
+                }
+            }
+        }
+        layer.swap(next_frontier);
+    }
+
+    // Walk back from end.
+    std::vector<TownID> route = {toid};
+    TownHandle current = town2_node;
+    for (Length level = route_roads - 1; level >= 0; --level)
+    {
+        TownHandle previous = NO_HANDLE;
+        for (auto road = graph->begin(current); road < graph->end(current); ++road)
+        {
+            TownHandle road_to = graph->targets[road];
+            if ((ws.side(road_to) & FROM_SIDE) && ws.cost(road_to).d == level && road_to < previous)
+            {
+                previous = road_to;
+            }
+        }
+        route.push_back(ids_[previous]);
+        current = previous;
+    }
+    std::reverse(route.begin(), route.end());
+    return route;
+}
+
+std::vector<TownID> Datastructures::road_cycle_route(TownID startid)
+{
+    // Get first node.
+    TownHandle start_node = find_handle(startid);
+    if (start_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+
+    // Road graph snapshot and this thread's workspace for the query.
+    std::shared_ptr<Road_graph const> graph = road_graph();
+    Route_workspace& ws = route_workspace();
+    ws.begin(ids_.size());
+
+    // Storing cycle information.
+    std::vector<TownHandle> cycle_road;
+    std::vector<TownID> cycle_id;
+    TownHandle current;
+
+    // Stack for road processing.
+    std::stack<TownHandle> road_stack = {};
+    bool cycle_found = false;
+    // Push first to stack
+    road_stack.push(start_node);
+
+    // Now we can start the DFS
+    while (!road_stack.empty())
+    {
+        if (cycle_found == true)
+        {
+            break;
+        }
+        // Top of the stack.
+        current = road_stack.top();
+        road_stack.pop();
+        // Push back elements to different vector.
+        cycle_road.push_back(current);
+
+        if (ws.colour(current) == WHITE)
+        {
+            road_stack.push(current);
+            ws.colour(current) = GRAY;
+            // Go through roads of a town.
+            for (auto road = graph->begin(current); road < graph->end(current); ++road)
+            {
+                TownHandle road_to_town = graph->targets[road];
+                // Is town visited?
+                if (ws.colour(road_to_town) == WHITE)
+                {
+                    ws.pi(road_to_town) = current;
+                    road_stack.push(road_to_town);
+                }
+                // Continue if last town.
+                if (road_to_town == ws.pi(current))
+                {
+                    continue;
+                }
+                // We are in the "loop"
+                else if (ws.colour(road_to_town) == GRAY)
+                {
+                    // But only depends on current pi.
+                    if (ws.pi(road_to_town) == current)
+                    {
+                        continue;
+                    }
+                    // Adding elements and breaking out.
+                    cycle_road.push_back(road_to_town);
+                    cycle_id.push_back(ids_[road_to_town]);
+                    cycle_found = true;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            cycle_road.pop_back();
+            ws.colour(current) = BLACK;
+        }
+    }
+
+    // If cycle is not found, then return empty.
+    if (cycle_found == false)
+    {
+        return {};
+    }
+
+    // Get the loop route.
+    for (TownHandle loop_elem = cycle_road.at(cycle_road.size() - 2);
+         loop_elem != NO_HANDLE; loop_elem = ws.pi(loop_elem))
+    {
+        cycle_id.push_back(ids_[loop_elem]);
+    }
+    std::reverse(cycle_id.begin(), cycle_id.end());
+    return cycle_id;
+
+}
+
+
+std::vector<TownID> Datastructures::shortest_route(TownID fromid, TownID toid)
+{
+    // Get start node and last node.
+    TownHandle start_node = find_handle(fromid);
+    TownHandle last_node = find_handle(toid);
+
+    // Check if start node and last node are found.
+    if (start_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+    if (last_node == NO_HANDLE)
+    {
+        return {NO_TOWNID};
+    }
+
+    // Route to town itself.
+    if (start_node == last_node)
+    {
+        return {fromid};
+    }
+
+    // No route between different components.
+    if (!towns_connected(start_node, last_node))
+    {
+        return {};
+    }
+
+    // Start a new query in this thread's workspace.
+    Route_workspace& ws = route_workspace();
+    ws.begin(ids_.size());
+
+    // Use contraction hierarchy if routing is prepared and towns are in it.
+    // It can choose other routes of equal length than A*, so route trees are
+    // not used with it.
+    std::shared_ptr<Contraction_hierarchy const> hierarchy = contraction_hierarchy();
+    if (hierarchy && start_node < hierarchy->town_count() && last_node < hierarchy->town_count())
+    {
+        std::vector<TownHandle> route_towns;
+        if (!hierarchy_route(ws, *hierarchy, start_node, last_node, route_towns))
+        {
+            return {};
+        }
+        std::vector<TownID> route = {};
+        route.reserve(route_towns.size());
+        for (TownHandle town : route_towns)
+        {
+            route.push_back(ids_[town]);
+        }
+        return route;
+    }
+
+    // Repeated queries from the same town walk its route tree.
+    if (std::shared_ptr<Route_tree const> tree = route_tree(start_node, SHORTEST_ROUTE))
+    {
+        return tree_route(*tree, last_node);
+    }
+
+    refresh_landmarks();
+    if (!a_star(ws, *road_graph(), start_node, last_node))
+    {
+        return {};
+    }
+
+    // Final route.
+    std::vector<TownID> route = {};
+    for (TownHandle route_iter = last_node; route_iter != NO_HANDLE; route_iter = ws.pi(route_iter))
+    {
+        route.push_back(ids_[route_iter]);
+    }
+    std::reverse(route.begin(), route.end());
+    return route;
+}
+
+std::vector<std::vector<TownID>> Datastructures::batch_routes(std::vector<Route_request> const& requests)
+{
+    // Build shared state once here instead of in the first queries.
+    road_graph();
+    refresh_landmarks();
+
+    std::vector<std::vector<TownID>> routes(requests.size());
+    work_stealing_for(requests.size(), [this, &requests, &routes](std::size_t i)
+    {
+        routes[i] = (this->*requests[i].route)(requests[i].fromid, requests[i].toid);
+    });
+    return routes;
+}
+
+std::shared_ptr<const Datastructures::Route_tree> Datastructures::route_tree(TownHandle source, Route_kind kind)
+{
+    std::uint64_t key = route_tree_key(source, kind);
+    {
+        std::lock_guard<std::mutex> lock(route_trees_mutex_);
+        auto found = route_tree_index_.find(key);
+        if (found != route_tree_index_.end())
+        {
+            if ((*found->second)->version == road_version_)
+            {
+                route_trees_.splice(route_trees_.begin(), route_trees_, found->second);
+                return route_trees_.front();
+            }
+            // Roads have changed since.
+            route_tree_towns_ -= (*found->second)->parents.size();
+            route_trees_.erase(found->second);
+            route_tree_index_.erase(found);
+        }
+        // Single queries from a town are cheaper with the usual search.
+        bool repeated = last_route_sources_[kind] == source;
+        last_route_sources_[kind] = source;
+        if (!repeated)
+        {
+            return nullptr;
+        }
+    }
+
+    // Towns added after the road graph snapshot have no roads and no tree.
+    std::shared_ptr<Road_graph const> graph = road_graph();
+    if (source + 1 >= graph->offsets.size())
+    {
+        return nullptr;
+    }
+    std::shared_ptr<Route_tree const> tree = build_route_tree(*graph, source, kind);
+    std::lock_guard<std::mutex> lock(route_trees_mutex_);
+    if (tree->version != road_version_ || tree->parents.size() > ROUTE_TREE_CACHE_TOWNS ||
+        route_tree_index_.count(key) != 0)
+    {
+        return tree;
+    }
+    route_trees_.push_front(tree);
+    route_tree_index_[key] = route_trees_.begin();
+    route_tree_towns_ += tree->parents.size();
+    // Evict least recently used trees.
+    while (route_tree_towns_ > ROUTE_TREE_CACHE_TOWNS)
+    {
+        Route_tree const& oldest = *route_trees_.back();
+        route_tree_towns_ -= oldest.parents.size();
+        route_tree_index_.erase(route_tree_key(oldest.source, oldest.kind));
+        route_trees_.pop_back();
+    }
+    return tree;
+}
+
+std::shared_ptr<const Datastructures::Route_tree> Datastructures::build_route_tree(Road_graph const& graph, TownHandle source, Route_kind kind)
+{
+    auto tree = std::make_shared<Route_tree>();
+    tree->source = source;
+    tree->kind = kind;
+    tree->version = graph.version;
+    auto& parents = tree->parents;
+    parents.assign(graph.offsets.size() - 1, NO_HANDLE);
+    parents[source] = source;
+
+    // Of the equally good parents, the one with smallest handle is taken, so
+    // that routes are the same as without the tree.
+    std::vector<std::uint32_t> roads(parents.size(), 0);
+    if (kind == LEAST_TOWNS_ROUTE)
+    {
+        // BFS, parents list is also the visited set.
+        std::vector<TownHandle> queue = {source};
+        for (std::size_t i = 0; i < queue.size(); ++i)
+        {
+            for (auto road = graph.begin(queue[i]); road < graph.end(queue[i]); ++road)
+            {
+                TownHandle town = graph.targets[road];
+                if (parents[town] == NO_HANDLE)
+                {
+                    parents[town] = queue[i];
+                    roads[town] = roads[queue[i]] + 1;
+                    queue.push_back(town);
+                }
+                else if (roads[town] == roads[queue[i]] + 1 && queue[i] < parents[town])
+                {
+                    parents[town] = queue[i];
+                }
+            }
+        }
+        return tree;
+    }
+
+    // Dijkstra on route length and then roads, as A* in shortest_route.
+    using Queue_item = std::tuple<Length, std::uint32_t, TownHandle>;
+    std::vector<Length> distances(parents.size(), NO_LENGTH);
+    std::vector<Queue_item> queue = {{0, 0, source}};
+    distances[source] = 0;
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+        Length distance = std::get<0>(queue.back());
+        std::uint32_t route_roads = std::get<1>(queue.back());
+        TownHandle current = std::get<2>(queue.back());
+        queue.pop_back();
+        if (std::make_pair(distance, route_roads) > std::make_pair(distances[current], roads[current]))
+        {
+            continue;
+        }
+        for (auto road = graph.begin(current); road < graph.end(current); ++road)
+        {
+            TownHandle town = graph.targets[road];
+            Length length = distance + graph.lengths[road];
+            if (std::make_pair(length, route_roads + 1) < std::make_pair(distances[town], roads[town]))
+            {
+                distances[town] = length;
+                roads[town] = route_roads + 1;
+                parents[town] = current;
+                queue.push_back({length, route_roads + 1, town});
+                std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+            }
+            else if (length == distances[town] && route_roads + 1 == roads[town] && current < parents[town])
+            {
+                parents[town] = current;
+            }
+        }
+    }
+    return tree;
+}
+
+std::vector<TownID> Datastructures::tree_route(Route_tree const& tree, TownHandle goal) const
+{
+    // Towns added after the tree was built have no roads.
+    if (goal >= tree.parents.size() || tree.parents[goal] == NO_HANDLE)
+    {
+        return {};
+    }
+    std::vector<TownID> route = {ids_[goal]};
+    for (TownHandle town = goal; town != tree.source; town = tree.parents[town])
+    {
+        route.push_back(ids_[tree.parents[town]]);
+    }
+    std::reverse(route.begin(), route.end());
+    return route;
+}
+
+std::vector<Distance> Datastructures::distance_matrix(std::vector<TownID> const& sources, std::vector<TownID> const& targets)
+{
+    std::vector<Distance> matrix(sources.size() * targets.size(), NO_DISTANCE);
+    // Handles of towns, NO_HANDLE for missing ones.
+    auto find_handles = [this](std::vector<TownID> const& ids)
+    {
+        std::vector<TownHandle> towns;
+        towns.reserve(ids.size());
+        for (TownID const& id : ids)
+        {
+            towns.push_back(find_handle(id));
+        }
+        return towns;
+    };
+    std::vector<TownHandle> source_towns = find_handles(sources);
+    std::vector<TownHandle> target_towns = find_handles(targets);
+
+    // Contraction hierarchy can be used if routing is prepared and all towns are in it.
+    std::shared_ptr<Contraction_hierarchy const> hierarchy = contraction_hierarchy();
+    auto in_hierarchy = [&hierarchy](TownHandle town) { return town == NO_HANDLE || town < hierarchy->town_count(); };
+    if (hierarchy && std::all_of(source_towns.begin(), source_towns.end(), in_hierarchy) &&
+        std::all_of(target_towns.begin(), target_towns.end(), in_hierarchy))
+    {
+        hierarchy_distances(*hierarchy, source_towns, target_towns, matrix);
+    }
+    else
+    {
+        road_graph_distances(*road_graph(), source_towns, target_towns, matrix);
+    }
+    return matrix;
+}
+
+void Datastructures::road_graph_distances(Road_graph const& graph, std::vector<TownHandle> const& sources,
+                                          std::vector<TownHandle> const& targets, std::vector<Distance>& matrix)
+{
+    // Distinct target towns. Search from a source can stop once those in its
+    // component are settled.
+    std::vector<TownHandle> target_set;
+    std::copy_if(targets.begin(), targets.end(), std::back_inserter(target_set),
+                 [](TownHandle town){ return town != NO_HANDLE; });
+    std::sort(target_set.begin(), target_set.end());
+    target_set.erase(std::unique(target_set.begin(), target_set.end()), target_set.end());
+    std::vector<bool> is_target(ids_.size(), false);
+    for (TownHandle town : target_set)
+    {
+        is_target[town] = true;
+    }
+    std::vector<std::size_t> reachable(sources.size(), 0);
+    for (std::size_t i = 0; i < sources.size(); ++i)
+    {
+        for (TownHandle town : target_set)
+        {
+            reachable[i] += sources[i] != NO_HANDLE && towns_connected(sources[i], town);
+        }
+    }
+
+    using Queue_item = std::pair<Length, TownHandle>;
+    std::size_t const town_count = ids_.size();
+    parallel_ranges(sources.size(), 1, [&](std::size_t first, std::size_t last)
+    {
+        Route_workspace& ws = route_workspace();
+        for (std::size_t i = first; i < last; ++i)
+        {
+            if (reachable[i] == 0)
+            {
+                continue;
+            }
+            ws.begin(town_count);
+            auto& queue = ws.forward_queue;
+            queue = {{0, sources[i]}};
+            ws.cost(sources[i]).d = 0;
+            for (std::size_t settled = 0; settled < reachable[i] && !queue.empty();)
+            {
+                std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+                Queue_item item = queue.back();
+                queue.pop_back();
+                if (item.first > ws.cost(item.second).d)
+                {
+                    continue;
+                }
+                settled += is_target[item.second];
+                for (auto road = graph.begin(item.second); road < graph.end(item.second); ++road)
+                {
+                    Length length = item.first + graph.lengths[road];
+                    if (length < ws.cost(graph.targets[road]).d)
+                    {
+                        ws.cost(graph.targets[road]).d = length;
+                        queue.push_back({length, graph.targets[road]});
+                        std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+                    }
+                }
+            }
+            // Targets in other components were never touched. Distances
+            // that don't fit in Distance are left as NO_DISTANCE.
+            for (std::size_t j = 0; j < targets.size(); ++j)
+            {
+                if (targets[j] != NO_HANDLE && ws.touched(targets[j]) &&
+                    ws.cost(targets[j]).d <= std::numeric_limits<Distance>::max())
+                {
+                    matrix[i * targets.size() + j] = static_cast<Distance>(ws.cost(targets[j]).d);
+                }
+            }
+        }
+    });
+}
+
+void Datastructures::upward_search(Route_workspace& ws, Contraction_hierarchy const& hierarchy, TownHandle town,
+                                   std::vector<std::pair<TownHandle, Length>>& reached)
+{
+    using Queue_item = std::pair<Length, TownHandle>;
+    ws.begin(hierarchy.town_count());
+    auto& queue = ws.forward_queue;
+    queue = {{0, town}};
+    ws.cost(town).d = 0;
+    reached.clear();
+    while (!queue.empty())
+    {
+        std::pop_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+        Queue_item item = queue.back();
+        queue.pop_back();
+        if (item.first > ws.cost(item.second).d)
+        {
+            continue;
+        }
+        reached.push_back({item.second, item.first});
+        for (std::uint32_t edge = hierarchy.begin(item.second); edge < hierarchy.end(item.second); ++edge)
+        {
+            Length length = item.first + hierarchy.lengths[edge];
+            if (length < ws.cost(hierarchy.targets[edge]).d)
+            {
+                ws.cost(hierarchy.targets[edge]).d = length;
+                queue.push_back({length, hierarchy.targets[edge]});
+                std::push_heap(queue.begin(), queue.end(), std::greater<Queue_item>());
+            }
+        }
+    }
+}
+
+void Datastructures::hierarchy_distances(Contraction_hierarchy const& hierarchy, std::vector<TownHandle> const& sources,
+                                         std::vector<TownHandle> const& targets, std::vector<Distance>& matrix)
+{
+    // Bucket of each town: targets whose upward search reached it, and distance.
+    std::vector<std::vector<std::pair<std::uint32_t, Length>>> buckets(hierarchy.town_count());
+    std::vector<std::pair<TownHandle, Length>> reached;
+    Route_workspace& ws = route_workspace();
+    for (std::uint32_t j = 0; j < targets.size(); ++j)
+    {
+        if (targets[j] == NO_HANDLE)
+        {
+            continue;
+        }
+        upward_search(ws, hierarchy, targets[j], reached);
+        for (auto [town, distance] : reached)
+        {
+            buckets[town].push_back({j, distance});
+        }
+    }
+
+    // Shortest route goes up from source and down to target, so it meets
+    // the target's upward search in some town reached by both.
+    parallel_ranges(sources.size(), 1, [&](std::size_t first, std::size_t last)
+    {
+        Route_workspace& ws = route_workspace();
+        std::vector<std::pair<TownHandle, Length>> reached;
+        std::vector<Length> row(targets.size());
+        for (std::size_t i = first; i < last; ++i)
+        {
+            if (sources[i] == NO_HANDLE)
+            {
+                continue;
+            }
+            std::fill(row.begin(), row.end(), NO_LENGTH);
+            upward_search(ws, hierarchy, sources[i], reached);
+            for (auto [town, distance] : reached)
+            {
+                for (auto [j, target_distance] : buckets[town])
+                {
+                    row[j] = std::min(row[j], distance + target_distance);
+                }
+            }
+            // Unreached targets and distances too long for Distance stay NO_DISTANCE.
+            for (std::size_t j = 0; j < targets.size(); ++j)
+            {
+                if (row[j] <= std::numeric_limits<Distance>::max())
+                {
+                    matrix[i * targets.size() + j] = static_cast<Distance>(row[j]);
+                }
+            }
+        }
+    });
+}
+
+Distance Datastructures::trim_road_network()
+{
+    // Collect each road once from the adjacency lists.
+    std::vector<Road_edge> edges;
+    edges.reserve(roads_.size());
+    for (TownHandle town = 0; town < roads_to_.size(); ++town)
+    {
+        for (Road_to const& road : roads_to_[town])
+        {
+            if (town < road.town)
+            {
+                edges.push_back({road.length, town, road.town, road.road});
+            }
+        }
+    }
+
+    // Find minimum spanning forest.
+    Union_find components(ids_.size());
+    std::vector<Road_edge> kept;
+    kept.reserve(std::min(edges.size(), ids_.size()));
+    filter_kruskal(edges.begin(), edges.end(), components, kept);
+
+    // Rewrite roads in one pass. Kept roads get new indices in road list.
+    std::vector<std::uint32_t> new_indices(roads_.size(), NO_ROAD);
+    std::vector<std::pair<TownID, TownID>> kept_roads;
+    std::vector<Road_info> kept_infos;
+    kept_roads.reserve(kept.size());
+    kept_infos.reserve(kept.size());
+    long long total_distance = 0;
+    for (Road_edge const& road : kept)
+    {
+        new_indices[road.road] = kept_roads.size();
+        kept_roads.push_back(std::move(roads_[road.road]));
+        kept_infos.push_back({road.town1, road.town2, 0, 0});
+        total_distance += road.length;
+    }
+    roads_ = std::move(kept_roads);
+    road_infos_ = std::move(kept_infos);
+
+    // Adjacency lists keep order of remaining roads.
+    road_index_.clear();
+    for (TownHandle town = 0; town < roads_to_.size(); ++town)
+    {
+        auto& roads_to = roads_to_[town];
+        std::uint32_t slot = 0;
+        for (Road_to const& road_to : roads_to)
+        {
+            std::uint32_t road = new_indices[road_to.road];
+            if (road == NO_ROAD)
+            {
+                continue;
+            }
+            roads_to[slot] = {road_to.town, road_to.length, road};
+            Road_info& info = road_infos_[road];
+            (info.town1 == town ? info.slot1 : info.slot2) = slot;
+            ++slot;
+        }
+        roads_to.resize(slot);
+    }
+    for (std::uint32_t road = 0; road < road_infos_.size(); ++road)
+    {
+        road_index_.insert({road_key(road_infos_[road].town1, road_infos_[road].town2), road});
+    }
+    invalidate_road_graph();
+    landmarks_dirty_ = true;
+
+    // Total can be too long for Distance.
+    if (total_distance > std::numeric_limits<Distance>::max())
+    {
+        return NO_DISTANCE;
+    }
+    return static_cast<Distance>(total_distance);
+}
+
+Datastructures::Union_find::Union_find(std::size_t town_capacity)
+{
+    grow(town_capacity);
+}
+
+void Datastructures::Union_find::grow(std::size_t town_capacity)
+{
+    for (TownHandle town = parents.size(); town < town_capacity; ++town)
+    {
+        parents.push_back(town);
+        sizes.push_back(1);
+    }
+}
+
+TownHandle Datastructures::Union_find::find(TownHandle town)
+{
+    TownHandle root = this->root(town);
+    // Make all towns on the path point directly to root.
+    while (parents[town] != root)
+    {
+        TownHandle next = parents[town];
+        parents[town] = root;
+        town = next;
+    }
+    return root;
+}
+
+TownHandle Datastructures::Union_find::root(TownHandle town) const
+{
+    while (parents[town] != town)
+    {
+        town = parents[town];
+    }
+    return town;
+}
+
+bool Datastructures::Union_find::unite(TownHandle town1, TownHandle town2)
+{
+    TownHandle root1 = find(town1);
+    TownHandle root2 = find(town2);
+    if (root1 == root2)
+    {
+        return false;
+    }
+    // Smaller set goes under bigger one.
+    if (sizes[root1] < sizes[root2])
+    {
+        std::swap(root1, root2);
+    }
+    parents[root2] = root1;
+    sizes[root1] += sizes[root2];
+    return true;
+}
+
+void Datastructures::Town_tree::insert(TownHandle town, Coord coord)
+{
+    std::uint32_t node = nodes.size();
+    nodes.push_back({coord, town, {NO_NODE, NO_NODE}, 1});
+    if (nodes_by_town.size() <= town)
+    {
+        nodes_by_town.resize(town + 1, NO_NODE);
+    }
+    nodes_by_town[town] = node;
+
+    // Walk down to a free child. Equal values go right.
+    path.clear();
+    std::uint32_t* link = &root;
+    while (*link != NO_NODE)
+    {
+        path.push_back(*link);
+        Node& parent = nodes[*link];
+        ++parent.size;
+        link = &parent.children[axis_value(coord, path.size() - 1) >= axis_value(parent.coord, path.size() - 1)];
+    }
+    *link = node;
+
+    // With alpha 3/4 depth may be at most log_{4/3}(size).
+    if (path.size() <= std::log(nodes[root].size) / std::log(4.0 / 3.0))
+    {
+        return;
+    }
+    // Scapegoat is the lowest master on path whose child holds over 3/4 of it.
+    std::uint32_t child = node;
+    for (std::size_t depth = path.size(); depth-- > 0; child = path[depth])
+    {
+        if (4 * std::uint64_t{nodes[child].size} > 3 * std::uint64_t{nodes[path[depth]].size})
+        {
+            if (depth == 0)
+            {
+                rebuild(root, 0);
+            }
+            else
+            {
+                Node& parent = nodes[path[depth - 1]];
+                rebuild(parent.children[parent.children[1] == path[depth]], depth);
+            }
+            return;
+        }
+    }
+}
+
+void Datastructures::Town_tree::remove(TownHandle town)
+{
+    // Leave tombstone. Rebuild when most of the tree is removed towns.
+    nodes[nodes_by_town[town]].town = NO_HANDLE;
+    nodes_by_town[town] = NO_NODE;
+    ++removed;
+}
+
+void Datastructures::Town_tree::rebalance()
+{
+    if (removed <= nodes.size() / 2)
+    {
+        return;
+    }
+    // Drop tombstones and build whole tree again.
+    std::vector<Node> live;
+    live.reserve(nodes.size() - removed);
+    for (Node const& node : nodes)
+    {
+        if (node.town != NO_HANDLE)
+        {
+            nodes_by_town[node.town] = live.size();
+            live.push_back(node);
+        }
+    }
+    nodes = std::move(live);
+    removed = 0;
+    std::vector<std::uint32_t> subtree(nodes.size());
+    for (std::uint32_t node = 0; node < nodes.size(); ++node)
+    {
+        subtree[node] = node;
+    }
+    root = build(subtree, 0, subtree.size(), 0);
+}
+
+std::vector<TownHandle> Datastructures::Town_tree::nearest(Coord coord, std::size_t k) const
+{
+    // Max-heap of the k best towns found so far.
+    std::vector<std::pair<long long, TownHandle>> best;
+    best.reserve(std::min(k, nodes.size()));
+    if (k > 0)
+    {
+        search(root, 0, coord, k, best);
+    }
+    std::sort_heap(best.begin(), best.end());
+
+    std::vector<TownHandle> towns;
+    towns.reserve(best.size());
+    for (auto const& town : best)
+    {
+        towns.push_back(town.second);
+    }
+    return towns;
+}
+
+int Datastructures::Town_tree::axis_value(Coord coord, unsigned int depth)
+{
+    return depth % 2 == 0 ? coord.x : coord.y;
+}
+
+void Datastructures::Town_tree::rebuild(std::uint32_t& link, unsigned int depth)
+{
+    // Collect nodes of the subtree.
+    std::vector<std::uint32_t> subtree = {link};
+    for (std::size_t i = 0; i < subtree.size(); ++i)
+    {
+        for (std::uint32_t child : nodes[subtree[i]].children)
+        {
+            if (child != NO_NODE)
+            {
+                subtree.push_back(child);
+            }
+        }
+    }
+    link = build(subtree, 0, subtree.size(), depth);
+}
+
+std::uint32_t Datastructures::Town_tree::build(std::vector<std::uint32_t>& subtree, std::size_t first,
+                                               std::size_t last, unsigned int depth)
+{
+    if (first == last)
+    {
+        return NO_NODE;
+    }
+    // Median of the range splits it.
+    std::size_t middle = first + (last - first) / 2;
+    std::nth_element(subtree.begin() + first, subtree.begin() + middle, subtree.begin() + last,
+                     [this, depth](std::uint32_t a, std::uint32_t b)
+    {return axis_value(nodes[a].coord, depth) < axis_value(nodes[b].coord, depth);});
+
+    std::uint32_t node = subtree[middle];
+    std::uint32_t left = build(subtree, first, middle, depth + 1);
+    std::uint32_t right = build(subtree, middle + 1, last, depth + 1);
+    nodes[node].children[0] = left;
+    nodes[node].children[1] = right;
+    nodes[node].size = last - first;
+    return node;
+}
+
+void Datastructures::Town_tree::search(std::uint32_t node, unsigned int depth, Coord coord, std::size_t k,
+                                       std::vector<std::pair<long long, TownHandle>>& best) const
+{
+    if (node == NO_NODE)
+    {
+        return;
+    }
+    Node const& current = nodes[node];
+    if (current.town != NO_HANDLE)
+    {
+        long long distance = squared_distance(current.coord, coord);
+        if (best.size() < k)
+        {
+            best.push_back({distance, current.town});
+            std::push_heap(best.begin(), best.end());
+        }
+        else if (distance < best.front().first)
+        {
+            std::pop_heap(best.begin(), best.end());
+            best.back() = {distance, current.town};
+            std::push_heap(best.begin(), best.end());
+        }
+    }
+
+    // Nearer side first. Other side only if splitting line is close enough.
+    long long split = static_cast<long long>(axis_value(coord, depth)) - axis_value(current.coord, depth);
+    search(current.children[split >= 0], depth + 1, coord, k, best);
+    if (best.size() < k || split * split <= best.front().first)
+    {
+        search(current.children[split < 0], depth + 1, coord, k, best);
+    }
+}
+
+bool Datastructures::same_component(TownID town1, TownID town2)
+{
+    // Check if towns exist.
+    TownHandle town1_node = find_handle(town1);
+    TownHandle town2_node = find_handle(town2);
+    if (town1_node == NO_HANDLE || town2_node == NO_HANDLE)
+    {
+        return false;
+    }
+    return towns_connected(town1_node, town2_node);
+}
+
+void Datastructures::add_component(TownHandle town)
+{
+    components_.sets.grow(town + 1);
+    components_.members.push_back({town});
+    components_.dirty.push_back(false);
+}
+
+void Datastructures::join_components(TownHandle town1, TownHandle town2)
+{
+    Union_find& sets = components_.sets;
+    TownHandle root1 = sets.find(town1);
+    TownHandle root2 = sets.find(town2);
+    if (!sets.unite(root1, root2))
+    {
+        return;
+    }
+    // Members of smaller component are moved to the new root.
+    TownHandle root = sets.find(root1);
+    TownHandle other = root == root1 ? root2 : root1;
+    auto& members = components_.members[root];
+    auto& moved = components_.members[other];
+    members.insert(members.end(), moved.begin(), moved.end());
+    moved = {};
+    components_.dirty[root] = components_.dirty[root] || components_.dirty[other];
+    components_.dirty[other] = false;
+}
+
+void Datastructures::mark_component_dirty(TownHandle town)
+{
+    components_.dirty[components_.sets.find(town)] = true;
+}
+
+bool Datastructures::towns_connected(TownHandle town1, TownHandle town2)
+{
+    std::lock_guard<std::mutex> lock(components_mutex_);
+    Union_find& sets = components_.sets;
+    TownHandle root = sets.find(town1);
+    if (root != sets.find(town2))
+    {
+        return false;
+    }
+    if (!components_.dirty[root])
+    {
+        return true;
+    }
+    // Component may have split since roads were removed.
+    split_component(root);
+    return sets.find(town1) == sets.find(town2);
+}
+
+void Datastructures::split_component(TownHandle root)
+{
+    Union_find& sets = components_.sets;
+    std::vector<TownHandle> towns = std::move(components_.members[root]);
+    components_.members[root] = {};
+
+    // Unlabel all towns of the component.
+    for (TownHandle town : towns)
+    {
+        sets.parents[town] = NO_HANDLE;
+    }
+
+    // Each unlabeled town starts a new component. BFS queue is the member
+    // list of the new component. Removed towns are left alone.
+    for (TownHandle town : towns)
+    {
+        if (sets.parents[town] != NO_HANDLE)
+        {
+            continue;
+        }
+        sets.parents[town] = town;
+        components_.dirty[town] = false;
+        auto& members = components_.members[town];
+        members = {town};
+        for (std::size_t i = 0; alive_[town] && i < members.size(); ++i)
+        {
+            for (Road_to const& road : roads_to_[members[i]])
+            {
+                if (sets.parents[road.town] == NO_HANDLE && alive_[road.town])
+                {
+                    sets.parents[road.town] = town;
+                    members.push_back(road.town);
+                }
+            }
+        }
+        sets.sizes[town] = members.size();
+    }
+}
+
+bool Datastructures::road_edge_less(const Road_edge &road1, const Road_edge &road2) const
+{
+    if (road1.length != road2.length)
+    {
+        return road1.length < road2.length;
+    }
+    // Equal lengths are ordered by IDs so that result doesn't depend on handles.
+    auto ids1 = std::minmax(ids_[road1.town1], ids_[road1.town2]);
+    auto ids2 = std::minmax(ids_[road2.town1], ids_[road2.town2]);
+    return ids1 < ids2;
+}
+
+void Datastructures::filter_kruskal(std::vector<Road_edge>::iterator first, std::vector<Road_edge>::iterator last,
+                                    Union_find& components, std::vector<Road_edge>& kept)
+{
+    std::size_t const kruskal_threshold = 4096;
+    std::size_t const filter_per_thread = 65536;
+
+    if (static_cast<std::size_t>(last - first) <= kruskal_threshold)
+    {
+        // Small set: plain Kruskal.
+        std::sort(first, last, [this](Road_edge const& road1, Road_edge const& road2)
+        { return road_edge_less(road1, road2); });
+        for (auto road = first; road != last; ++road)
+        {
+            if (components.unite(road->town1, road->town2))
+            {
+                kept.push_back(*road);
+            }
+        }
+        return;
+    }
+
+    // Partition around length of a random road. Equal lengths stay on the
+    // shorter side so that ties are still handled in ID order.
+    Length pivot = (first + random_in_range<long>(0, last - first - 1))->length;
+    auto middle = std::partition(first, last, [pivot](Road_edge const& road){ return road.length <= pivot; });
+    if (middle == last)
+    {
+        // All roads as long as pivot or shorter: split at pivot length instead.
+        middle = std::partition(first, last, [pivot](Road_edge const& road){ return road.length < pivot; });
+        if (middle == first)
+        {
+            // All roads have the same length.
+            std::sort(first, last, [this](Road_edge const& road1, Road_edge const& road2)
+            { return road_edge_less(road1, road2); });
+            for (auto road = first; road != last; ++road)
+            {
+                if (components.unite(road->town1, road->town2))
+                {
+                    kept.push_back(*road);
+                }
+            }
+            return;
+        }
+    }
+    filter_kruskal(first, middle, components, kept);
+
+    // Filter out longer roads whose towns are already connected. Finding roots
+    // only reads union-find, so ranges of roads are checked in parallel.
+    std::size_t count = last - middle;
+    std::vector<char> needed(count);
+    parallel_ranges(count, filter_per_thread, [&components, &needed, middle](std::size_t begin, std::size_t end)
+    {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            Road_edge const& road = *(middle + i);
+            needed[i] = components.root(road.town1) != components.root(road.town2);
+        }
+    });
+    auto filtered_last = middle;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        if (needed[i])
+        {
+            *filtered_last++ = *(middle + i);
+        }
+    }
+    filter_kruskal(middle, filtered_last, components, kept);
 }
@@ -9,18 +9,31 @@
 #include <utility>
 #include <limits>
 #include <functional>
+#include <iterator>
 #include <exception>
 #include <set>
+#include <list>
 #include <queue>
 #include <stack>
+#include <unordered_map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 
 // Types for IDs
 using TownID = std::string;
 using Name = std::string;
 
+// Type for dense town handles. Each TownID is interned to a handle once in
+// add_town, and the handle indexes all per-town arrays of Datastructures.
+using TownHandle = std::uint32_t;
+
 // Return values for cases where required thing was not found
 TownID const NO_TOWNID = "----------";
 
+// Handle value for cases where town was not found (or has no master etc.)
+TownHandle const NO_HANDLE = std::numeric_limits<TownHandle>::max();
+
 // Return value for cases where integer values were not found
 int const NO_VALUE = std::numeric_limits<int>::min();
 
@@ -36,25 +49,26 @@ struct Coord
 
 enum Colour { WHITE, GRAY, BLACK };
 
+// Road and route length used by route algorithms. Roads can be longer than
+// INT_MAX for int coordinates, and routes much longer, so it is 64 bits.
+using Length = long long;
+Length const NO_LENGTH = std::numeric_limits<Length>::max();
+
 struct Cost
 {
-    int d;
-    int de;
+    Length d;
+    Length de;
+    // Roads on route, breaks ties between equally long routes.
+    std::uint32_t roads;
 };
-struct Town_info
+
+// Road from a town in adjacency lists: neighbour town, road length (which
+// is calculated once when road is added) and index of the road in road list.
+struct Road_to
 {
-    TownID id{};
-    Name name{};
-    Coord coords{};
-    int tax{};
-
-    std::vector<Town_info*> vassals{};
-    Town_info* master{};
-
-    std::vector<Town_info*> roads_to{};
-    Colour colour;
-    Town_info* pi{};
-    Cost cost;
+    TownHandle town;
+    Length length;
+    std::uint32_t road;
 };
 
 // Example: Defining == and hash function for Coord so that it can be used
@@ -128,10 +142,12 @@ public:
     // from the container. Linear similarly to unordered_map::clear.
     void clear_all();
 
-    // Estimate of performance: Constant on average.
+    // Estimate of performance: O(log^2(N)) amortized.
     // Short rationale for estimate: We can assume creating a struct always takes a
     // constant time. Unordered_map::find operator is constant in average according to
-    // cppreference.
+    // cppreference. Inserting to distance order (std::set) is O(log(N)). Inserting to
+    // the 2-d town tree is O(log(N)), and rebuilding its unbalanced subtrees is
+    // O(log^2(N)) amortized.
     bool add_town(TownID id, Name const& name, Coord coord, int tax);
 
     // Estimate of performance: Constant on average.
@@ -158,52 +174,57 @@ public:
     // on the size N of a container, therefore performance is linear on the size of container.
     std::vector<TownID> all_towns();
 
-    // Estimate of performance: Linear on the size N of the container.
-    // Short rationale for estimate: Goes through all the elements of container and
-    // compares each element to the name of the town. If town name is found, push_back
-    // into a vector. Since we loop N times, operation is at least linear. Since push_back
-    // is amortized constant, we can assume operation is linear on the size N of container.
+    // Estimate of performance: Linear on the number of towns M with the name,
+    // constant on average if there are none.
+    // Short rationale for estimate: Towns with the name are found from name index
+    // (unordered_map, constant on average). Their ids are push_backed into a vector,
+    // which is linear on M.
     std::vector<TownID> find_towns(Name const& name);
 
     // Estimate of performance: Constant on average.
     // Short rationale for estimate: unordered_map::at and unordered_map::find operations
-    // are both constant on average according to documentation (cppreference). Therefore
+    // are both constant on average according to documentation (cppreference). Town is
+    // moved in name index from old name to new name, which is also constant on average,
+    // since it knows its slot in the list of towns with old name. Therefore
     // operation is constant on average.
     bool change_town_name(TownID id, Name const& newname);
 
-    // Estimate of performance: Worst case N*log(N), where N is first-last comparisons.
-    // Short rationale for estimate: std::sort is at worst (N*log(N)) according to
-    // cppreference, where N is range of container (first-last comparisons).
-    // push_back is constant, therefore push_backing in a loop is linear on
-    // average. Copying unordered map to vector is linear in the size of container.
-    // Therefore for worst asymptotically N*log(N).
+    // Estimate of performance: Linear in the number of towns N, plus M*log(M)
+    // where M is number of towns added or renamed since the previous call.
+    // Short rationale for estimate: Towns are kept in a name-ordered vector.
+    // add_town and change_town_name only append the town to a pending list,
+    // and renamed or removed towns leave stale entries. Here pending towns are
+    // sorted (M*log(M)) and merged with the ordered vector while stale entries
+    // are dropped, which is linear. Reading the ids is also linear.
     std::vector<TownID> towns_alphabetically();
 
-    // Estimate of performance: Worst case N*log(N), where N is first-last comparisons.
-    // Short rationale for estimate: We can assume cmath operation sqrt is fairly close
-    // to constant, especially when we work with fairly small numbers in the program.
-    // std::sort is at worst (N*log(N)) according to cppreference, where N is range of
-    // container (first-last comparisons). Push_back is constant and in a loop it is
-    // adding all elements, so adding all elements in a vector is linear overall.
-    // Therefore asymptotically N*log(N)
+    // Estimate of performance: Linear in the number of towns N.
+    // Short rationale for estimate: Towns are kept in a std::set ordered by
+    // squared distance from origin, which add_town and remove_town update in
+    // O(log(N)). Listing is a linear read of the set with push_back, which is
+    // amortized constant.
     std::vector<TownID> towns_distance_increasing();
 
-    // Estimate of performance: Linear on average, where N is size of container.
-    // Short rationale for estimate: Goes through a container of size N in a for loop.
-    // Does if-comparisons which are constant in time complexity. Also assigns values
-    // which is constant.
+    // Estimate of performance: Constant.
+    // Short rationale for estimate: Nearest town is first element of the
+    // set of towns ordered by distance from origin.
     TownID min_distance();
 
-    // Estimate of performance: Linear on average, where N is size of container.
-    // Short rationale for estimate: Goes through a container of size N in a for loop.
-    // Does if-comparisons which are constant in time complexity. Also assigns values
-    // which is constant.
+    // Estimate of performance: Constant.
+    // Short rationale for estimate: Furthest town is last element of the
+    // set of towns ordered by distance from origin.
     TownID max_distance();
 
-    // Estimate of performance: Constant.
+    // Estimate of performance: O(log(N)) amortized, at worst linear in the
+    // length H of master chain of master.
     // Short rationale for estimate: unordered_map::find is on average constant
     // operation. Push_back is amortized constant, since we dont reserve memory.
-    // If conditions are constant. Overall constant.
+    // If conditions are constant. Vassalship that would make a cycle is rejected
+    // by finding root of master's tree in link-cut tree, O(log(N)) amortized.
+    // Tax paid by vassal is added to cached tax income of master, and the
+    // change goes up the master chain only as long as the tax each master pays
+    // to its own master changes. Usually that stops quickly, since 10% of a
+    // small change truncates to zero.
     bool add_vassalship(TownID vassalid, TownID masterid);
 
     // Estimate of performance: Worst case linear in the size N of vassal container.
@@ -213,6 +234,56 @@ public:
     // back in a vector. Amortized linear.
     std::vector<TownID> get_town_vassals(TownID id);
 
+    // Vassals of a town as a view over its vassal list, in vassal order.
+    // Iterating gives ids without copying them. View is valid until vassals
+    // of the town change.
+    class Vassals_view
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = TownID;
+            using difference_type = std::ptrdiff_t;
+            using pointer = TownID const*;
+            using reference = TownID const&;
+
+            iterator(Datastructures const* ds, TownHandle town) : ds_{ds}, town_{town} {}
+            reference operator*() const { return ds_->ids_[town_]; }
+            pointer operator->() const { return &ds_->ids_[town_]; }
+            iterator& operator++() { town_ = ds_->vassal_links_[town_].next; return *this; }
+            iterator operator++(int) { iterator old = *this; ++*this; return old; }
+            bool operator==(iterator const& other) const { return town_ == other.town_; }
+            bool operator!=(iterator const& other) const { return town_ != other.town_; }
+
+        private:
+            Datastructures const* ds_;
+            TownHandle town_;
+        };
+
+        Vassals_view(Datastructures const* ds, TownHandle town) : ds_{ds}, town_{town} {}
+        iterator begin() const { return {ds_, town_ == NO_HANDLE ? NO_HANDLE : ds_->vassal_links_[town_].first}; }
+        iterator end() const { return {ds_, NO_HANDLE}; }
+        std::size_t size() const { return town_ == NO_HANDLE ? 0 : ds_->vassal_links_[town_].count; }
+        bool empty() const { return size() == 0; }
+
+    private:
+        Datastructures const* ds_;
+        TownHandle town_;
+    };
+
+    // Estimate of performance: Constant on average.
+    // Short rationale for estimate: Town is found from unordered_map, constant on
+    // average. Nothing is copied. View is empty if town doesn't exist.
+    Vassals_view get_town_vassals_view(TownID id) const;
+
+    // Estimate of performance: Linear in the number N of vassals.
+    // Short rationale for estimate: Same as get_town_vassals, but ids are assigned
+    // to caller's buffer, so its capacity (and capacity of its strings) is reused.
+    // Returns false and leaves buffer empty if town doesn't exist.
+    bool get_town_vassals(TownID id, std::vector<TownID>& vassals) const;
+
     // Estimate of performance: Worst case linear in vassal towns N found.
     // Best case constant, town doesnt exist.
     // Short rationale for estimate: Best case: No town found, unordered_map::find
@@ -222,11 +293,16 @@ public:
     std::vector<TownID> taxer_path(TownID id);
 
 
-    // Estimate of performance: Worst case: Linear in N vassals of old master)
+    // Estimate of performance: Linear in the number N of vassals and D of roads
+    // of removed town, plus O(log(T)) where T is number of towns.
     // Best case constant, towns dont exist.
     // Short rationale for estimate: Best case: No town found, unordered_map::find
-    // is constant. Worst case: Both towns exist. Looping is linear operation.
-    // updating vassal's master is constant. Overall linear. Push_back constant.
+    // is constant. Worst case: Both towns exist. Updating master of each vassal
+    // is linear. Vassal lists are intrusive linked lists, so taking removed town
+    // out of its master's list and moving its vassals there are constant. Each
+    // road knows its slots in adjacency lists and road list, so it is removed
+    // in constant time like in remove_road. Distance order and town tree are
+    // updated in O(log(T)).
     bool remove_town(TownID id);
 
     // Estimate of performance: Worst case: N*log(N), best case constant, N is first-last elements
@@ -234,20 +310,116 @@ public:
     // complexity, where N is first-last elements, according to cppreference.
     std::vector<TownID> towns_nearest(Coord coord);
 
-    // Estimate of performance: Linear in the total of towns N called recursively.
-    // Short rationale for estimate: Goes through all vassals, subvassals etc. of a node
-    // recursively. Visits all N vassalnodes once, therefore linear in the total of towns
-    // as vassals or subvassals. Operations inside recursion are constant in time complexity
-    // so overall, operation is linear.
+    // Estimate of performance: O(log(N) + k*log(k)) on average, where N is
+    // number of towns. O(N*log(N)) if town tree has to be rebuilt first.
+    // Short rationale for estimate: Towns are kept in a 2-d tree that
+    // add_town and remove_town update. Search keeps k best towns in a heap
+    // and skips subtrees that can't contain anything closer. add_town keeps
+    // the tree balanced by rebuilding subtrees that get too deep, and whole
+    // tree is rebuilt here only when most of it are removed towns.
+    std::vector<TownID> towns_nearest(Coord coord, unsigned int k);
+
+    // Estimate of performance: Linear in the length L of the path. After hierarchy
+    // edits below the town, linear in the number of changed towns and their vassals.
+    // Short rationale for estimate: Each town caches height of its vassal tree and
+    // the vassal with the longest path. Edits only mark the master chain dirty, and
+    // dirty towns are recalculated here in iterative post-order, which doesn't go
+    // into clean subtrees. Then path is followed through best vassal links.
     std::vector<TownID> longest_vassal_path(TownID id);
 
-    // Estimate of performance: Linear in the total of towns N called recursively.
-    // Short rationale for estimate: Goes through all vassals, subvassals etc of a node
-    // recursively. Visits all N vassalnodes once, therefore operation is linear in the total
-    // of vassals called recursively. Inside recursion operations are constant, so
-    // overall operation is linear.
+    // Estimate of performance: Constant on average.
+    // Short rationale for estimate: Town is found from unordered_map, constant on
+    // average. Tax income of each town (own tax plus taxes from vassals) is cached
+    // and kept valid by add_vassalship and remove_town, so only tax to master has to
+    // be subtracted.
     int total_net_tax(TownID id);
 
+    // Taxer path of a town as a view: iterating goes from the town up the master
+    // chain and gives ids without copying them into a vector. View is valid
+    // until the town is removed or clear_all is called.
+    class Taxer_path_view
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = TownID;
+            using difference_type = std::ptrdiff_t;
+            using pointer = TownID const*;
+            using reference = TownID const&;
+
+            iterator(Datastructures const* ds, TownHandle town) : ds_{ds}, town_{town} {}
+            reference operator*() const { return ds_->ids_[town_]; }
+            pointer operator->() const { return &ds_->ids_[town_]; }
+            iterator& operator++() { town_ = ds_->masters_[town_]; return *this; }
+            iterator operator++(int) { iterator old = *this; ++*this; return old; }
+            bool operator==(iterator const& other) const { return town_ == other.town_; }
+            bool operator!=(iterator const& other) const { return town_ != other.town_; }
+
+        private:
+            Datastructures const* ds_;
+            TownHandle town_;
+        };
+
+        Taxer_path_view(Datastructures const* ds, TownHandle town) : ds_{ds}, town_{town} {}
+        iterator begin() const { return {ds_, town_}; }
+        iterator end() const { return {ds_, NO_HANDLE}; }
+        bool empty() const { return town_ == NO_HANDLE; }
+
+    private:
+        Datastructures const* ds_;
+        TownHandle town_;
+    };
+
+    // Estimate of performance: Constant on average. Iterating the view is linear
+    // in the length of the path.
+    // Short rationale for estimate: Town is found from unordered_map, constant on
+    // average. Nothing is copied until the view is iterated. View is empty if
+    // town doesn't exist.
+    Taxer_path_view taxer_path_view(TownID id);
+
+    // Estimate of performance: O(log(N)). O(N*log(N)) for the first call after
+    // hierarchy has changed.
+    // Short rationale for estimate: Jump pointers to 2^k:th master of each town
+    // (binary lifting) are rebuilt when hierarchy has changed since last query.
+    // With them vassal is lifted to the depth of master in O(log(N)) jumps.
+    // Returns true if vassal pays tax to master directly or through its masters.
+    bool is_under(TownID vassalid, TownID masterid);
+
+    // Estimate of performance: O(log(N)). O(N*log(N)) for the first call after
+    // hierarchy has changed.
+    // Short rationale for estimate: Lower town is lifted to the depth of the
+    // other, and then both are lifted with decreasing jumps while their masters
+    // differ, both O(log(N)) with the jump pointers. Returns the lowest town that
+    // both towns are or pay tax to, or NO_TOWNID if there is none.
+    TownID common_master(TownID id1, TownID id2);
+
+    // Estimate of performance: Constant on average. O(N*log(N)) for the first
+    // call after hierarchy has changed.
+    // Short rationale for estimate: Depth (number of masters above town) is
+    // stored with the jump pointers. Returns NO_VALUE if town doesn't exist.
+    int depth(TownID id);
+
+    // Estimate of performance: O(log(N)) amortized.
+    // Short rationale for estimate: Hierarchy is also kept in a link-cut tree,
+    // where the master chain of a town is one splay tree after access. Tax sum
+    // of the chain is kept at splay tree roots. Returns sum of own taxes of the
+    // town and all its masters, or NO_VALUE if town doesn't exist.
+    int taxer_path_tax(TownID id);
+
+    // Estimate of performance: O(log(N)) amortized plus linear in the lengths
+    // of the master chains of old and new master.
+    // Short rationale for estimate: Vassal lists are intrusive linked lists, so
+    // vassal is taken out of old master's list in constant time. It is cut from
+    // its old master and linked to the new one in the link-cut tree, taking its
+    // whole vassal tree with it. Cached taxes and heights are updated up both
+    // master chains like in add_vassalship, stopping where nothing changes.
+    // Cycle check is one access in the link-cut tree, O(log(N)) amortized, and
+    // is done before anything changes. Returns false if towns don't exist or
+    // master is vassal or its vassal.
+    bool change_master(TownID vassalid, TownID masterid);
+
 
     // Phase 2 operations
 
@@ -264,13 +436,22 @@ public:
     // Returning a vector is constant time
     std::vector<std::pair<TownID, TownID>> all_roads();
 
-    // Estimate of performance: O(N), where N is amount of roads.
-    // Short rationale for estimate: Best case is constant time,
-    // since if town doesn't exist we return. unordered_map find
-    // is constant time. Most demanding operation
-    // in time complexity in function is looping through all
-    // town's roads. Looping is O(N) if road doesn't exist.
-    // Vector push_back is constant. Therefore, O(N)
+    // Estimate of performance: Constant.
+    // Short rationale for estimate: Returns reference to road list without
+    // copying. Reference is valid until roads change.
+    std::vector<std::pair<TownID, TownID>> const& all_roads_view() const;
+
+    // Estimate of performance: Constant on average without landmarks, plus
+    // the size of the smaller component when the road joins two components
+    // (O(log(N)) amortized per town). With L landmarks O(L*(N+K)*log(N)) in
+    // the worst case, where N is number of towns and K number of roads.
+    // Short rationale for estimate: Towns and existing road are found from
+    // unordered_maps, constant on average, and vector push_back is amortized
+    // constant. Joining components moves member list of the smaller one to
+    // the larger, so each town is moved O(log(N)) times in total. Landmark
+    // distances are kept up to date with a Dijkstra per landmark that visits
+    // only towns that got closer, which is every town when the road joins
+    // two large components.
     bool add_road(TownID town1, TownID town2);
 
     // Estimate of performance: Best case constant, worst
@@ -280,31 +461,113 @@ public:
     // have to push_back N towns which we then return.
     std::vector<TownID> get_roads_from(TownID id);
 
+    // Towns at the other end of roads of a town, as a view over its adjacency
+    // list. Iterating gives ids without copying them. View is valid until
+    // roads change.
+    class Roads_from_view
+    {
+    public:
+        class iterator
+        {
+        public:
+            using iterator_category = std::random_access_iterator_tag;
+            using value_type = TownID;
+            using difference_type = std::ptrdiff_t;
+            using pointer = TownID const*;
+            using reference = TownID const&;
+
+            iterator(Datastructures const* ds, Road_to const* road) : ds_{ds}, road_{road} {}
+            reference operator*() const { return ds_->ids_[road_->town]; }
+            pointer operator->() const { return &ds_->ids_[road_->town]; }
+            reference operator[](difference_type n) const { return ds_->ids_[road_[n].town]; }
+            iterator& operator++() { ++road_; return *this; }
+            iterator operator++(int) { iterator old = *this; ++road_; return old; }
+            iterator& operator--() { --road_; return *this; }
+            iterator operator--(int) { iterator old = *this; --road_; return old; }
+            iterator& operator+=(difference_type n) { road_ += n; return *this; }
+            iterator& operator-=(difference_type n) { road_ -= n; return *this; }
+            iterator operator+(difference_type n) const { return {ds_, road_ + n}; }
+            iterator operator-(difference_type n) const { return {ds_, road_ - n}; }
+            difference_type operator-(iterator const& other) const { return road_ - other.road_; }
+            bool operator==(iterator const& other) const { return road_ == other.road_; }
+            bool operator!=(iterator const& other) const { return road_ != other.road_; }
+            bool operator<(iterator const& other) const { return road_ < other.road_; }
+            bool operator>(iterator const& other) const { return road_ > other.road_; }
+            bool operator<=(iterator const& other) const { return road_ <= other.road_; }
+            bool operator>=(iterator const& other) const { return road_ >= other.road_; }
+            friend iterator operator+(difference_type n, iterator const& it) { return it + n; }
+
+        private:
+            Datastructures const* ds_;
+            Road_to const* road_;
+        };
+
+        Roads_from_view(Datastructures const* ds, Road_to const* first, Road_to const* last)
+            : ds_{ds}, first_{first}, last_{last} {}
+        iterator begin() const { return {ds_, first_}; }
+        iterator end() const { return {ds_, last_}; }
+        std::size_t size() const { return last_ - first_; }
+        bool empty() const { return first_ == last_; }
+
+    private:
+        Datastructures const* ds_;
+        Road_to const* first_;
+        Road_to const* last_;
+    };
+
+    // Estimate of performance: Constant on average.
+    // Short rationale for estimate: Town is found from unordered_map, constant on
+    // average. Nothing is copied. View is empty if town doesn't exist.
+    Roads_from_view get_roads_from_view(TownID id) const;
+
+    // Estimate of performance: Linear in the number N of roads of town.
+    // Short rationale for estimate: Same as get_roads_from, but ids are assigned
+    // to caller's buffer, so its capacity (and capacity of its strings) is reused.
+    // Returns false and leaves buffer empty if town doesn't exist.
+    bool get_roads_from(TownID id, std::vector<TownID>& towns) const;
+
     // Estimate of performance: Returns least_towns_route,
     // Which is O(N+K) at worst, where N roads and K edges.
     // Short rationale for estimate: Check least towns route.
-    // function returns from least_towns_route.
+    // function returns from least_towns_route, so it also stops
+    // as soon as the bidirectional search meets.
     std::vector<TownID> any_route(TownID fromid, TownID toid);
 
     // Non-compulsory phase 2 operations
 
-    // Estimate of performance: Best case constant. Worst case
-    // O(N)
-    // Short rationale for estimate: Best case is when town is
-    // not found. Unordered_map is average then. Worst case is
-    // when both towns are found. We loop 2 times, checking for
-    // existing road. If it exists, both operations are separate
-    // and O(N). Lastly we loop all roads K from another data structure
-    // and remove it. Efficiency is based on assumption that there are
-    // always more towns than roads.
+    // Estimate of performance: O(α(N)) amortized, where α is inverse of
+    // Ackermann function (practically constant). After roads have been removed
+    // from the component of the towns, first call is O(N+K) of that component.
+    // Short rationale for estimate: Connected components are kept in a
+    // union-find that add_road updates. Removing roads may split a component,
+    // so the component is only marked dirty and its towns are relabeled by a
+    // BFS over the component when it is queried next time.
+    bool same_component(TownID town1, TownID town2);
+
+    // Estimate of performance: Constant on average.
+    // Short rationale for estimate: Road is found from road index
+    // (unordered_map, constant on average). Road knows its positions in
+    // both towns' adjacency lists and in road list, so it is removed from
+    // each of them by moving the last element in its place and popping,
+    // which is constant.
     bool remove_road(TownID town1, TownID town2);
 
-    // Estimate of performance: O(N+K) BFS. Best case constant.
+    // Estimate of performance: O(N+K) bidirectional BFS. Best case constant.
     // is O(N+K), where N is number of nodes and K is number of edges.
-    // Short rationale for estimate: We at worst have to visit all edges
-    // and all nodes. Queue pop and queue push are constant in time.
-    // Therefore, at worst O(N+K). BFS is O(N+K) anyways according
-    // to documentations. Best case: unordereded map find didnt find.
+    // Short rationale for estimate: At worst (no route) the smaller side has
+    // to visit all edges and nodes of its component. Usually searches from
+    // both ends meet after visiting a small part of the component, since the
+    // side with smaller frontier is always expanded one whole level at a time.
+    // Search stops at the first meeting, which is hop-optimal. Of equally
+    // short routes the same one is always returned: route is walked back from
+    // the end through the neighbour with smallest handle that is one road
+    // closer to start, which needs about one more level of end side towns.
+    // Repeated queries from a town walk its BFS tree, which chooses the same.
+    // Traversal state is in a per-thread workspace, so there is no O(N)
+    // initialisation and several threads can run route queries at once.
+    // First route query after roads have changed builds a contiguous
+    // snapshot of the road graph in O(N+K). Towns in different components
+    // are rejected before searching, see same_component.
     std::vector<TownID> least_towns_route(TownID fromid, TownID toid);
 
     // Estimate of performance: Algorithm is based on DFS. DFS at worst
@@ -316,36 +579,620 @@ public:
     std::vector<TownID> road_cycle_route(TownID startid);
 
     // Estimate of performance: Algorithm is based on A*-algorithm.
-    // Worst case situation for A* is O((N+K)log(N+K)), where N
+    // Worst case situation for A* is O((N+K)log(N)), where N
     // is number of nodes and K is number of edges.
     // Short rationale for estimate: A* is based on Dijsktra, which
-    // is O((N+K)log(N+K)) at worst. A* works a little bit more efficiently
+    // is O((N+K)log(N)) at worst. A* works a little bit more efficiently
     // compared to Dijkstra at best case though, but it highly depends. Log comes from
-    // priority_queue.top() and push being O(logN). At worst N nodes and K
-    // edges have to be visited.
+    // the indexed 4-ary heap: pop and decrease-key are O(logN), and each town is in
+    // the heap at most once. At worst N nodes and K edges have to be visited.
+    // Roads are read from the same road graph snapshot as least_towns_route.
+    // Towns in different components are rejected first, see same_component.
+    // If routing has been prepared (see prepare_routing), shortest_route uses the
+    // contraction hierarchy instead: bidirectional Dijkstra that only goes up to
+    // more important towns, which visits a few hundred towns even on big networks.
+    // Town reached shorter from a more important town is not searched further.
+    // Otherwise A* estimates are tightened with landmarks, see prepare_landmarks.
+    // A* estimate is straight line scaled by the smallest ratio of road length
+    // to straight line, because rounded roads can be shorter than the straight
+    // line. So A* is exact, but a single short slanted road weakens it. Routes
+    // are compared by length and then by roads, and of equal routes the one
+    // through smaller handles is chosen, so repeated queries from a town can
+    // walk its Dijkstra tree and get the same route. Route trees are not used
+    // with contraction hierarchy, which can choose another equal route.
     std::vector<TownID> shortest_route(TownID fromid, TownID toid);
 
-    // Estimate of performance:
-    // Short rationale for estimate:
+    // Estimate of performance: Roughly O(N*log(N) + K) times cost of local
+    // witness searches, where N is number of towns and K number of roads.
+    // Short rationale for estimate: Builds a contraction hierarchy for
+    // shortest_route. Towns are contracted one at a time in order of edge
+    // difference (shortcuts added minus roads removed), which is updated for
+    // neighbours of each contracted town and again when a town comes up. A
+    // shortcut is added between neighbours only if a bounded Dijkstra doesn't
+    // find a route as short without the contracted town. Roads between far
+    // apart towns make the last towns contracted densely connected, and then
+    // time grows faster than N. Hierarchy is dropped by any change to roads,
+    // after which shortest_route uses A* again.
+    void prepare_routing();
+
+    // Estimate of performance: O(L*N + L*(N+K)*log(N)/T), where L is count,
+    // N number of towns, K number of roads and T number of hardware threads.
+    // Short rationale for estimate: Chooses count landmark towns far from each
+    // other (farthest point by straight line) and runs Dijkstra from each of
+    // them in parallel. A* in shortest_route then also uses lower bound
+    // |d(l,town) - d(l,goal)| (triangle inequality) of each landmark l, which
+    // is much tighter than straight line when roads detour. Added roads update
+    // distances incrementally; other road changes make the next route query
+    // recompute the tables. Count 0 drops landmarks.
+    void prepare_landmarks(unsigned int count);
+
+    // Estimate of performance: O(S*(N+K)*log(N)/T), where S is number of
+    // sources, N number of towns, K number of roads and T number of hardware
+    // threads. With prepared routing O((S+M)*U*log(U) + S*U*B), where M is
+    // number of targets, U size of upward search and B towns per bucket.
+    // Short rationale for estimate: Returns road distances from each source to
+    // each target, row by row (sources.size() rows of targets.size() values),
+    // NO_DISTANCE if either town doesn't exist, there's no route or distance
+    // is too long for Distance. Distances are summed in 64 bits. Without
+    // prepared routing Dijkstra is run from each source in parallel until all
+    // targets in its component are settled. With contraction hierarchy the
+    // upward searches of targets leave their distances in buckets of the towns
+    // they reach, and the upward search of each source only scans buckets.
+    // Routes themselves are never built.
+    std::vector<Distance> distance_matrix(std::vector<TownID> const& sources, std::vector<TownID> const& targets);
+
+    // Route query of batch_routes: route function is any_route,
+    // least_towns_route or shortest_route.
+    struct Route_request
+    {
+        std::vector<TownID> (Datastructures::*route)(TownID, TownID);
+        TownID fromid;
+        TownID toid;
+    };
+
+    // Estimate of performance: O(R*Q/T), where R is number of requests, Q
+    // cost of single route query and T number of hardware threads.
+    // Short rationale for estimate: Results are the same as calling the route
+    // functions one by one, since routes don't depend on earlier queries or
+    // cached route trees (see shortest_route). Road graph snapshot and
+    // landmarks are prepared first, so the workers only read shared data
+    // (apart from the locked route tree cache) and use their own route
+    // workspaces. Requests are spread over a work-stealing
+    // pool: a worker that has finished its share takes half of the remaining
+    // share of another worker, which balances long and short queries.
+    std::vector<std::vector<TownID>> batch_routes(std::vector<Route_request> const& requests);
+
+    // Estimate of performance: O(K log K) at worst, where K is number of
+    // roads. Usually close to O(K + N log N log(K/N)) (filter-Kruskal).
+    // Short rationale for estimate: Minimum spanning forest is found with
+    // filter-Kruskal: roads are partitioned around a random pivot length, and
+    // longer roads whose towns are already connected are filtered out before
+    // they are ever sorted. Filtering is split across cores for big road sets.
+    // Union-find with path compression and union by size is almost constant.
+    // Remaining roads are written back in one O(N+K) pass. Total length is
+    // summed in 64 bits, and NO_DISTANCE is returned if it is too long for
+    // Distance (roads are still trimmed).
     Distance trim_road_network();
 
 private:
 
-    int get_distance_from_coord(std::pair<TownID, Town_info> const &town, Coord coord);
+    // Returns handle of town id, or NO_HANDLE if town doesn't exist.
+    TownHandle find_handle(TownID const& id) const;
+
+    // Squared distance between coordinates. Orders towns the same way as
+    // distance but without sqrt or overflow.
+    static long long squared_distance(Coord coord1, Coord coord2);
+
+    // Tax that a town with gross tax income pays to its master.
+    static int tax_to_master(int gross_tax);
 
-    std::vector<TownID> recursive_find_longest(Town_info*);
+    // Adds change to gross tax income of town and goes up the master chain
+    // as long as tax paid to master changes.
+    void propagate_tax(TownHandle town, int change);
 
-    int recursive_total_net_tax(Town_info* node);
+    // Interning layer: TownID -> dense handle.
+    std::unordered_map<TownID, TownHandle> handles_by_id_;
 
-    std::unordered_map<TownID, Town_info> towns_by_id_;
+    // Per-town data as parallel arrays indexed by TownHandle. Handles of
+    // removed towns are marked dead in alive_ and never reused until clear_all.
+    std::vector<TownID> ids_;
+    std::vector<Name> names_;
+    std::vector<Coord> coords_;
+    std::vector<int> taxes_;
+    std::vector<bool> alive_;
 
+    std::vector<TownHandle> masters_;
+
+    std::vector<std::vector<Road_to>> roads_to_;
+
+    // Vassals of each town as an intrusive doubly linked list in vassal order.
+    // first and last are vassals of the town, prev and next its siblings in
+    // the list of its master. Unlinking a town and splicing a whole list to
+    // the end of another are constant.
+    struct Vassal_links
+    {
+        TownHandle first = NO_HANDLE;
+        TownHandle last = NO_HANDLE;
+        TownHandle prev = NO_HANDLE;
+        TownHandle next = NO_HANDLE;
+        std::uint32_t count = 0;
+    };
+    std::vector<Vassal_links> vassal_links_;
+
+    // Adds vassal to the end of master's vassal list.
+    void append_vassal(TownHandle master, TownHandle vassal);
+    // Takes vassal out of the vassal list of its master.
+    void detach_vassal(TownHandle master, TownHandle vassal);
+    // Moves all vassals of town to the end of master's vassal list.
+    void splice_vassals(TownHandle town, TownHandle master);
+
+    // Own tax plus taxes paid by direct vassals.
+    std::vector<int> gross_taxes_;
+    // Number of towns on longest vassal path down from town, and first vassal
+    // on that path. Valid unless town is marked dirty. If a town is dirty,
+    // so are all its masters.
+    std::vector<std::uint32_t> heights_;
+    std::vector<TownHandle> best_vassals_;
+    std::vector<bool> heights_dirty_;
+
+    // Binary lifting over the vassal forest: jumps_[k][town] is 2^k:th master
+    // of town (or NO_HANDLE). Rebuilt when hierarchy_version_ has changed
+    // since jumps were built, which only happens when some town gets a new
+    // master. New towns are added as roots without rebuilding.
+    std::vector<std::vector<TownHandle>> jumps_;
+    std::vector<std::uint32_t> depths_;
+    std::uint64_t hierarchy_version_ = 0;
+    std::uint64_t jumps_version_ = std::numeric_limits<std::uint64_t>::max();
+
+    // Rebuilds depths and jump pointers if hierarchy has changed.
+    void update_jumps();
+    // Returns master of town levels steps up.
+    TownHandle lift(TownHandle town, std::uint32_t levels) const;
+
+    // Link-cut tree over the vassal forest. Each preferred path is a splay tree
+    // ordered by depth, and parent of a splay tree root is the path-parent.
+    // Removed towns stay in the tree as ghosts with zero tax, so that their
+    // vassals don't have to be moved one by one.
+    struct Vassal_forest
+    {
+        struct Node
+        {
+            TownHandle children[2];
+            TownHandle parent;
+            int tax;
+            long long tax_sum;
+        };
+        std::vector<Node> nodes;
+
+        void add(TownHandle town, int tax);
+        void set_tax(TownHandle town, int tax);
+        // Links root town under master.
+        void link(TownHandle town, TownHandle master);
+        // Cuts town from its master, if it has one.
+        void cut(TownHandle town);
+        TownHandle find_root(TownHandle town);
+        // Returns true if master is town or one of its masters.
+        bool is_master_of(TownHandle master, TownHandle town);
+        // Tax sum of town and all its masters.
+        long long path_tax(TownHandle town);
+
+    private:
+        bool is_splay_root(TownHandle town) const;
+        void update(TownHandle town);
+        void rotate(TownHandle town);
+        void splay(TownHandle town);
+        void access(TownHandle town);
+    };
+    Vassal_forest vassal_forest_;
+
+    // Makes town without master a vassal of master. Caller checks cycles.
+    void link_vassal(TownHandle vassal, TownHandle master);
+    // Removes vassal from its master.
+    void unlink_vassal(TownHandle vassal);
+    // Returns true if master is vassal or in its vassal tree. Leaves vassal
+    // cut from its ghost masters in the vassal forest.
+    bool would_cycle(TownHandle vassal, TownHandle master);
+
+    // Marks town and its master chain dirty after vassals of town changed.
+    void mark_height_dirty(TownHandle town);
+    // Recalculates heights of dirty towns in vassal tree of town.
+    void update_heights(TownHandle town);
+
+    // Towns ordered by squared distance from origin (0,0).
+    std::set<std::pair<long long, TownHandle>> towns_by_distance_;
+
+    // Name index: name -> towns with that name. name_slots_ has position of
+    // each town in its name's list, so that towns are removed by swap-and-pop.
+    std::unordered_map<Name, std::vector<TownHandle>> handles_by_name_;
+    std::vector<std::uint32_t> name_slots_;
+
+    // Name order index: towns sorted by name, and towns added or renamed
+    // after the last merge. Entry is stale if town has been removed or
+    // renamed after the entry was made, i.e. the versions don't match.
+    struct Name_order_entry
+    {
+        TownHandle town;
+        std::uint32_t version;
+    };
+    std::vector<Name_order_entry> towns_by_name_;
+    std::vector<Name_order_entry> pending_by_name_;
+    std::vector<std::uint32_t> name_versions_;
+    std::size_t stale_by_name_ = 0;
+
+    // Marks old name order entry of town stale and adds town to pending list.
+    void reorder_by_name(TownHandle town);
+    // Merges pending towns into name order and drops stale entries.
+    void merge_pending_by_name();
+
+    // Adds town to name index under its current name.
+    void add_to_name_index(TownHandle town);
+    // Removes town from name index under its current name.
+    void remove_from_name_index(TownHandle town);
+
+    // List of roads as ID pairs (smaller ID first). road_infos_ is a parallel
+    // list with handles of road's towns and positions in their adjacency lists.
+    struct Road_info
+    {
+        TownHandle town1;
+        TownHandle town2;
+        std::uint32_t slot1;
+        std::uint32_t slot2;
+    };
     std::vector<std::pair<TownID, TownID>> roads_;
+    std::vector<Road_info> road_infos_;
+
+    // Road index: unordered pair of town handles -> index in road list.
+    static std::uint64_t road_key(TownHandle town1, TownHandle town2);
+    std::unordered_map<std::uint64_t, std::uint32_t> road_index_;
+
+    // Returns index of road between towns in road list, or NO_ROAD.
+    static constexpr std::uint32_t NO_ROAD = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t find_road(TownHandle town1, TownHandle town2) const;
+
+    // Removes road from road index, road list and adjacency lists of its towns.
+    // Doesn't invalidate road graph or connectivity.
+    void erase_road(std::uint32_t road);
+
+    // Removes road from adjacency list of town by moving last road in its place.
+    void remove_road_slot(TownHandle town, std::uint32_t slot);
+
+    // Straight line distance between towns, calculated in 64 bits so that
+    // it doesn't overflow for any int coordinates.
+    Length get_road_length(TownHandle, TownHandle);
+
+    // A* heap key: estimated length of route through town, then its roads.
+    using Heap_key = std::pair<Length, std::uint32_t>;
+
+    // Per-query traversal state of route algorithms. Entries are valid only
+    // if their stamp equals the current epoch, so starting a new query is
+    // O(1) instead of resetting every town.
+    struct Route_workspace
+    {
+        std::vector<std::uint32_t> stamps;
+        std::vector<Colour> colours;
+        std::vector<TownHandle> pis;
+        std::vector<Cost> costs;
+        // Bidirectional search: successor towards goal and visited sides.
+        std::vector<TownHandle> nexts;
+        std::vector<std::uint8_t> sides;
+        // A* heap: position of each town in heap_items.
+        std::vector<std::uint32_t> heap_positions;
+        std::vector<std::pair<Heap_key, TownHandle>> heap_items;
+        // Queues of bidirectional Dijkstra (binary heaps with stale entries).
+        std::vector<std::pair<Length, TownHandle>> forward_queue;
+        std::vector<std::pair<Length, TownHandle>> backward_queue;
+        std::uint32_t epoch = 0;
+
+        // Starts a new query for towns with handles below town_capacity.
+        void begin(std::size_t town_capacity);
+        // Returns true if town has been touched during current query.
+        bool touched(TownHandle town) const { return stamps[town] == epoch; }
+        // Initialises town's state on first touch of the query.
+        void touch(TownHandle town);
+
+        Colour& colour(TownHandle town) { touch(town); return colours[town]; }
+        TownHandle& pi(TownHandle town) { touch(town); return pis[town]; }
+        Cost& cost(TownHandle town) { touch(town); return costs[town]; }
+        TownHandle& next(TownHandle town) { touch(town); return nexts[town]; }
+        std::uint8_t& side(TownHandle town) { touch(town); return sides[town]; }
+        std::uint32_t& heap_position(TownHandle town) { touch(town); return heap_positions[town]; }
+    };
+
+    // Indexed min-heap of towns with 4 children per node, used by A*. Each town
+    // is in the heap at most once and its key can be decreased in O(logN).
+    // Storage and town positions are kept in the workspace so they are reused.
+    class Town_heap
+    {
+    public:
+        explicit Town_heap(Route_workspace& ws);
+        bool empty() const { return items_.empty(); }
+        // Adds town with key, or decreases key of town already in heap.
+        void push_or_decrease(TownHandle town, Heap_key key);
+        // Removes and returns town with smallest key.
+        TownHandle pop();
+
+    private:
+        static constexpr std::uint32_t NOT_IN_HEAP = std::numeric_limits<std::uint32_t>::max();
+        void sift_up(std::size_t pos);
+        void sift_down(std::size_t pos);
+        void place(std::size_t pos, std::pair<Heap_key, TownHandle> item);
+
+        Route_workspace& ws_;
+        std::vector<std::pair<Heap_key, TownHandle>>& items_;
+    };
+
+    // Side flags of Route_workspace::sides
+    static constexpr std::uint8_t FROM_SIDE = 1;
+    static constexpr std::uint8_t TO_SIDE = 2;
+
+    // Each thread has its own workspace, so route queries can run
+    // concurrently on the same (unchanging) Datastructures.
+    static Route_workspace& route_workspace();
+
+    // Frozen compressed sparse row (CSR) snapshot of the road network, used by
+    // route queries. Roads of town t are targets and lengths at indices
+    // [begin(t), end(t)). Towns added after the snapshot have no roads in it.
+    struct Road_graph
+    {
+        std::vector<std::uint32_t> offsets;
+        std::vector<TownHandle> targets;
+        std::vector<Length> lengths;
+        // Smallest ratio of road length to straight line between its towns,
+        // so straight line times it is a lower bound of route length.
+        double length_ratio = 1;
+        // Value of road_version_ when snapshot was built.
+        std::uint64_t version = 0;
+
+        std::uint32_t begin(TownHandle town) const { return town + 1 < offsets.size() ? offsets[town] : 0; }
+        std::uint32_t end(TownHandle town) const { return town + 1 < offsets.size() ? offsets[town + 1] : 0; }
+    };
+
+    // Returns current road graph snapshot. It is built lazily on the first
+    // route query after roads have changed.
+    std::shared_ptr<Road_graph const> road_graph();
+
+    // Drops road graph snapshot. Called whenever roads change.
+    void invalidate_road_graph();
+
+    std::shared_ptr<Road_graph const> road_graph_;
+    std::mutex road_graph_mutex_;
+    // Incremented whenever roads change (add_road, remove_road, clear_roads,
+    // remove_town and trim_road_network all invalidate the road graph).
+    std::uint64_t road_version_ = 0;
+
+    // Contraction hierarchy: for each town, edges to towns contracted after it
+    // (upward edges) in CSR form. Shortcut edge has the town it bypasses as
+    // middle, original road has NO_HANDLE. Towns added after the hierarchy was
+    // built are not in it.
+    struct Contraction_hierarchy
+    {
+        std::vector<std::uint32_t> offsets;
+        std::vector<TownHandle> targets;
+        std::vector<Length> lengths;
+        std::vector<TownHandle> middles;
+
+        std::size_t town_count() const { return offsets.size() - 1; }
+        std::uint32_t begin(TownHandle town) const { return offsets[town]; }
+        std::uint32_t end(TownHandle town) const { return offsets[town + 1]; }
+        // Index of upward edge between towns, in either direction.
+        std::uint32_t find_edge(TownHandle town1, TownHandle town2) const;
+    };
+
+    // Builds contraction hierarchy of road graph snapshot.
+    static std::shared_ptr<Contraction_hierarchy const> contract_road_graph(Road_graph const& graph);
+
+    // Returns contraction hierarchy if routing is prepared, else nullptr.
+    std::shared_ptr<Contraction_hierarchy const> contraction_hierarchy();
+
+    // Bidirectional upward Dijkstra on hierarchy. On success, route from start
+    // to goal with shortcuts unpacked is put in route.
+    bool hierarchy_route(Route_workspace& ws, Contraction_hierarchy const& hierarchy,
+                         TownHandle start, TownHandle goal, std::vector<TownHandle>& route);
+
+    // Stall on demand: true if town is reached shorter than length from a more
+    // important town, so the search doesn't need to go on from it.
+    static bool is_stalled(Route_workspace& ws, Contraction_hierarchy const& hierarchy, TownHandle town,
+                           Length length, bool is_forward);
+
+    // Dropped with road graph snapshot.
+    std::shared_ptr<Contraction_hierarchy const> contraction_hierarchy_;
+
+    // Dijkstra from town over upward edges of hierarchy only. Towns reached
+    // and their distances are put in reached.
+    static void upward_search(Route_workspace& ws, Contraction_hierarchy const& hierarchy, TownHandle town,
+                              std::vector<std::pair<TownHandle, Length>>& reached);
+
+    // Distance matrix parts of distance_matrix. Entries of missing towns,
+    // unreachable pairs and distances too long for Distance are left as they
+    // are in matrix.
+    void road_graph_distances(Road_graph const& graph, std::vector<TownHandle> const& sources,
+                              std::vector<TownHandle> const& targets, std::vector<Distance>& matrix);
+    static void hierarchy_distances(Contraction_hierarchy const& hierarchy, std::vector<TownHandle> const& sources,
+                                    std::vector<TownHandle> const& targets, std::vector<Distance>& matrix);
+
+    // Landmark (ALT) tables: road distance from each landmark to each town,
+    // NO_LENGTH if unreachable, stored town by town (L entries per town).
+    // Towns added after the tables were computed have no entries.
+    struct Landmarks
+    {
+        unsigned int count = 0;
+        std::vector<TownHandle> towns;
+        std::vector<Length> distances;
+    };
+
+    // Dijkstra from landmark over road graph. Distances has an entry per town.
+    static void landmark_distances(Road_graph const& graph, TownHandle landmark, std::vector<Length>& distances);
 
-    int get_road_length(Town_info*, Town_info*);
+    // Chooses landmark towns and computes their tables from the road graph.
+    void build_landmarks();
 
-    void relax_A(Town_info*, Town_info*, Town_info*);
+    // Lowers landmark distances through road town1-town2 that was just added.
+    void add_landmark_road(TownHandle town1, TownHandle town2, Length length);
 
-    int min_est(Town_info*, Town_info*);
+    // Recomputes landmark tables if roads were removed since. Route queries
+    // call this before reading the tables.
+    void refresh_landmarks();
+
+    Landmarks landmarks_;
+    bool landmarks_dirty_ = false;
+    std::mutex landmarks_mutex_;
+
+    // Route query kinds that can be answered from a cached route tree.
+    enum Route_kind { LEAST_TOWNS_ROUTE = 0, SHORTEST_ROUTE = 1 };
+
+    // Route tree from source: parent of each town towards source (source is
+    // its own parent), NO_HANDLE if not reached. Valid while road_version_
+    // equals version.
+    struct Route_tree
+    {
+        TownHandle source;
+        Route_kind kind;
+        std::uint64_t version;
+        std::vector<TownHandle> parents;
+    };
+
+    // Key of route tree in route_tree_index_.
+    static std::uint64_t route_tree_key(TownHandle source, Route_kind kind)
+    {
+        return (static_cast<std::uint64_t>(source) << 1) | kind;
+    }
+
+    // Returns cached route tree of source, or builds it if previous query of
+    // the kind was from the same source. Otherwise, or if source was added
+    // after the road graph snapshot, returns nullptr and the query is done
+    // with the usual search.
+    std::shared_ptr<Route_tree const> route_tree(TownHandle source, Route_kind kind);
+
+    // BFS (least towns) or Dijkstra (shortest) tree of whole component of
+    // source, choosing parents as least_towns_route and shortest_route do.
+    // Source must be a town of the graph.
+    static std::shared_ptr<Route_tree const> build_route_tree(Road_graph const& graph, TownHandle source, Route_kind kind);
+
+    // Route from tree's source to goal by walking parents, empty if not reached.
+    std::vector<TownID> tree_route(Route_tree const& tree, TownHandle goal) const;
+
+    // Cached route trees, most recently used first, and their index by source
+    // and kind. Trees are evicted from the back when they have more than
+    // ROUTE_TREE_CACHE_TOWNS parents in total (4 bytes each).
+    static constexpr std::size_t ROUTE_TREE_CACHE_TOWNS = std::size_t{1} << 24;
+    std::list<std::shared_ptr<Route_tree const>> route_trees_;
+    std::unordered_map<std::uint64_t, std::list<std::shared_ptr<Route_tree const>>::iterator> route_tree_index_;
+    std::size_t route_tree_towns_ = 0;
+    TownHandle last_route_sources_[2] = {NO_HANDLE, NO_HANDLE};
+    std::mutex route_trees_mutex_;
+
+    // Road as an edge of the road network, for minimum spanning forest.
+    struct Road_edge
+    {
+        Length length;
+        TownHandle town1;
+        TownHandle town2;
+        std::uint32_t road;
+    };
+
+    // Union-find over town handles with path compression and union by size.
+    struct Union_find
+    {
+        std::vector<TownHandle> parents;
+        std::vector<std::uint32_t> sizes;
+
+        explicit Union_find(std::size_t town_capacity);
+        // Adds towns up to town_capacity as their own sets.
+        void grow(std::size_t town_capacity);
+        // Root of town's set, compressing the path on the way.
+        TownHandle find(TownHandle town);
+        // Root of town's set without modifying anything, so that several
+        // threads can call it at the same time.
+        TownHandle root(TownHandle town) const;
+        // Joins sets of towns. Returns false if they were in the same set.
+        bool unite(TownHandle town1, TownHandle town2);
+    };
+
+    // 2-d tree of town coordinates for nearest town queries. Even levels
+    // split by x, odd levels by y. Subtree that gets too unbalanced on insert
+    // is rebuilt (scapegoat tree), so depth stays logarithmic even for sorted
+    // or equal coordinates. Removed towns are left in the tree as tombstones
+    // until the whole tree is rebuilt.
+    struct Town_tree
+    {
+        static constexpr std::uint32_t NO_NODE = std::numeric_limits<std::uint32_t>::max();
+
+        struct Node
+        {
+            Coord coord;
+            TownHandle town;
+            std::uint32_t children[2];
+            // Number of nodes in subtree, tombstones included.
+            std::uint32_t size;
+        };
+
+        std::vector<Node> nodes;
+        std::vector<std::uint32_t> nodes_by_town;
+        std::uint32_t root = NO_NODE;
+        std::size_t removed = 0;
+        // Nodes from root to parent of inserted node.
+        std::vector<std::uint32_t> path;
+
+        void insert(TownHandle town, Coord coord);
+        void remove(TownHandle town);
+        // Rebuilds a balanced tree of live towns if most nodes are tombstones.
+        void rebalance();
+        // Up to k towns nearest to coord, in increasing distance.
+        std::vector<TownHandle> nearest(Coord coord, std::size_t k) const;
+
+    private:
+        static int axis_value(Coord coord, unsigned int depth);
+        // Rebuilds subtree at link, whose root is at depth, balanced.
+        void rebuild(std::uint32_t& link, unsigned int depth);
+        std::uint32_t build(std::vector<std::uint32_t>& subtree, std::size_t first, std::size_t last,
+                            unsigned int depth);
+        void search(std::uint32_t node, unsigned int depth, Coord coord, std::size_t k,
+                    std::vector<std::pair<long long, TownHandle>>& best) const;
+    };
+    Town_tree town_tree_;
+
+    // Connected components of the road network. Members of each component
+    // are listed at its root, so that a dirty component (one whose roads have
+    // been removed) can be relabeled by going through only its own towns.
+    struct Connectivity
+    {
+        Union_find sets{0};
+        std::vector<std::vector<TownHandle>> members;
+        std::vector<char> dirty;
+    };
+    Connectivity components_;
+    std::mutex components_mutex_;
+
+    // Adds town as its own component.
+    void add_component(TownHandle town);
+    // Joins components of towns connected by a new road.
+    void join_components(TownHandle town1, TownHandle town2);
+    // Marks component of town as possibly split.
+    void mark_component_dirty(TownHandle town);
+    // Returns true if there is a route between towns. Relabels a dirty
+    // component first. Thread-safe.
+    bool towns_connected(TownHandle town1, TownHandle town2);
+    // Relabels towns of dirty component with root by BFS over their roads.
+    void split_component(TownHandle root);
+
+    // Order of roads in minimum spanning forest: by length, ties by town IDs.
+    bool road_edge_less(Road_edge const& road1, Road_edge const& road2) const;
+
+    // Filter-Kruskal over roads in [first, last). Roads of the spanning forest
+    // are appended to kept.
+    void filter_kruskal(std::vector<Road_edge>::iterator first, std::vector<Road_edge>::iterator last,
+                        Union_find& components, std::vector<Road_edge>& kept);
+
+    // Relaxes road u-v and returns true if v got a better estimate.
+    bool relax_A(Route_workspace&, Road_graph const& graph, TownHandle u, TownHandle v, Length length, TownHandle g);
+
+    // A* search from start to goal. Route is left in workspace pi handles.
+    // Returns true if goal was reached.
+    bool a_star(Route_workspace& ws, Road_graph const& graph, TownHandle start, TownHandle goal);
+
+    // Lower bound of road distance: scaled straight line, or landmark bound if
+    // better. It never drops by more than road length, so A* needs no reopening.
+    Length min_est(Road_graph const& graph, TownHandle, TownHandle);
 };
 
 #endif // DATASTRUCTURES_HH
@@ -78,6 +78,9 @@ using std::vector;
 #include <set>
 using std::set;
 
+#include <unordered_map>
+using std::unordered_map;
+
 #include <array>
 using std::array;
 
@@ -209,6 +212,28 @@ MainProgram::CmdResult MainProgram::cmd_add_vassalship(std::ostream& output, Mai
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_change_master(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID vassalid = *begin++;
+    TownID masterid = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    bool ok = ds_.change_master(vassalid, masterid);
+    if (ok)
+    {
+        auto vassalname = ds_.get_town_name(vassalid);
+        auto mastername = ds_.get_town_name(masterid);
+        output << "Changed master: " << vassalname << " -> " << mastername << endl;
+    }
+    else
+    {
+        output << "Changing master failed!" << endl;
+    }
+
+    view_dirty = true;
+    return {};
+}
+
 MainProgram::CmdResult MainProgram::cmd_add_road(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
 {
     TownID town1id = *begin++;
@@ -254,6 +279,29 @@ MainProgram::CmdResult MainProgram::cmd_remove_road(std::ostream& output, MainPr
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_same_component(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID town1id = *begin++;
+    TownID town2id = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    bool result = ds_.same_component(town1id, town2id);
+    output << town1id << " and " << town2id
+           << (result ? " are in the same component" : " are not in the same component") << endl;
+
+    return {};
+}
+
+void MainProgram::test_same_component()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id1 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        auto id2 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        ds_.same_component(id1, id2);
+    }
+}
+
 void MainProgram::test_remove_road()
 {
     if (random_towns_added_ > 0) // Don't do anything if there's no towns
@@ -331,16 +379,141 @@ void MainProgram::test_total_net_tax()
     }
 }
 
+MainProgram::CmdResult MainProgram::cmd_taxer_path_view(std::ostream& /*output*/, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID id = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto view = ds_.taxer_path_view(id);
+    if (view.empty()) { return {ResultType::HIERARCHY, {NO_TOWNID}}; }
+    else { return {ResultType::HIERARCHY, vector<TownID>(view.begin(), view.end())}; }
+}
+
+void MainProgram::test_taxer_path_view()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        for (auto& pathid : ds_.taxer_path_view(id)) { (void)pathid; }
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_is_under(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID vassalid = *begin++;
+    TownID masterid = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    bool result = ds_.is_under(vassalid, masterid);
+    output << vassalid << (result ? " is under " : " is not under ") << masterid << endl;
+
+    return {};
+}
+
+void MainProgram::test_is_under()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id1 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        auto id2 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        ds_.is_under(id1, id2);
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_common_master(std::ostream& /*output*/, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID id1 = *begin++;
+    TownID id2 = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto result = ds_.common_master(id1, id2);
+    return {ResultType::LIST, {result}};
+}
+
+void MainProgram::test_common_master()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id1 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        auto id2 = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        ds_.common_master(id1, id2);
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_depth(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID id = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto result = ds_.depth(id);
+    output << "Depth of " << id << ": ";
+    if (result != NO_VALUE)
+    {
+        output << result << endl;
+    }
+    else
+    {
+        output << "NO_VALUE" << endl;
+    }
+
+    return {};
+}
+
+void MainProgram::test_depth()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        ds_.depth(id);
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_taxer_path_tax(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    TownID id = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    auto result = ds_.taxer_path_tax(id);
+    output << "Taxer path tax of " << id << ": ";
+    if (result != NO_VALUE)
+    {
+        output << result << endl;
+    }
+    else
+    {
+        output << "NO_VALUE" << endl;
+    }
+
+    return {};
+}
+
+void MainProgram::test_taxer_path_tax()
+{
+    if (random_towns_added_ > 0) // Don't do anything if there's no towns
+    {
+        auto id = n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_));
+        ds_.taxer_path_tax(id);
+    }
+}
+
 MainProgram::CmdResult MainProgram::cmd_towns_nearest(ostream& /*output*/, MatchIter begin, MatchIter end)
 {
     string xstr = *begin++;
     string ystr = *begin++;
+    string countstr = *begin++;
     assert( begin == end && "Impossible number of parameters!");
 
     int x = convert_string_to<int>(xstr);
     int y = convert_string_to<int>(ystr);
 
-    auto result = ds_.towns_nearest({x, y});
+    if (countstr.empty())
+    {
+        auto result = ds_.towns_nearest({x, y});
+        return {ResultType::LIST, result};
+    }
+
+    unsigned int count = convert_string_to<unsigned int>(countstr);
+    auto result = ds_.towns_nearest({x, y}, count);
 
     return {ResultType::LIST, result};
 }
@@ -352,6 +525,7 @@ void MainProgram::test_towns_nearest()
     ds_.towns_nearest({x, y});
 }
 
+
 MainProgram::CmdResult MainProgram::cmd_remove_town(ostream& output, MatchIter begin, MatchIter end)
 {
     string id = *begin++;
@@ -490,17 +664,25 @@ MainProgram::CmdResult MainProgram::cmd_all_roads(std::ostream& output, MainProg
 {
     assert( begin == end && "Impossible number of parameters!");
 
-    auto roads = ds_.all_roads();
+    // Sort pointers to roads instead of copying them.
+    auto const& roads = ds_.all_roads_view();
     if (roads.empty())
     {
         output << "No roads!" << endl;
     }
 
-    std::sort(roads.begin(), roads.end());
+    std::vector<std::pair<TownID, TownID> const*> sorted_roads;
+    sorted_roads.reserve(roads.size());
+    for (auto const& road : roads)
+    {
+        sorted_roads.push_back(&road);
+    }
+    std::sort(sorted_roads.begin(), sorted_roads.end(), [](auto a, auto b){ return *a < *b; });
 
     unsigned long int n = 1;
-    for (auto const& p : roads)
+    for (auto const* road : sorted_roads)
     {
+        auto const& p = *road;
         auto coord1 = ds_.get_town_coordinates(p.first);
         auto coord2 = ds_.get_town_coordinates(p.second);
         auto dist = calc_distance(coord1, coord2);
@@ -521,7 +703,11 @@ MainProgram::CmdResult MainProgram::cmd_town_vassals(std::ostream& output, MainP
     string id = *begin++;
     assert( begin == end && "Impossible number of parameters!");
 
-    auto vassals = ds_.get_town_vassals(id);
+    std::vector<TownID> vassals;
+    if (!ds_.get_town_vassals(id, vassals))
+    {
+        return {ResultType::LIST, {NO_TOWNID}};
+    }
     std::sort(vassals.begin(), vassals.end());
 
     if (vassals.empty())
@@ -529,7 +715,7 @@ MainProgram::CmdResult MainProgram::cmd_town_vassals(std::ostream& output, MainP
         output << "No towns!" << endl;
     }
 
-    return {ResultType::LIST, vassals};
+    return {ResultType::LIST, std::move(vassals)};
 }
 
 void MainProgram::test_town_vassals()
@@ -546,15 +732,19 @@ MainProgram::CmdResult MainProgram::cmd_roads_from(std::ostream& output, MainPro
     string id = *begin++;
     assert( begin == end && "Impossible number of parameters!");
 
-    auto vassals = ds_.get_roads_from(id);
-    if (vassals.empty())
+    std::vector<TownID> towns;
+    if (!ds_.get_roads_from(id, towns))
+    {
+        return {ResultType::LIST, {NO_TOWNID}};
+    }
+    if (towns.empty())
     {
         output << "No roads!" << endl;
     }
 
-    std::sort(vassals.begin(), vassals.end());
+    std::sort(towns.begin(), towns.end());
 
-    return {ResultType::LIST, vassals};
+    return {ResultType::LIST, std::move(towns)};
 }
 
 void MainProgram::test_roads_from()
@@ -879,7 +1069,10 @@ MainProgram::CmdResult MainProgram::cmd_trim_road_network(std::ostream& output,
     Distance total_dist;
     total_dist = ds_.trim_road_network();
 
-    output << "The remaining road network has total distance of " << total_dist << std::endl;
+    output << "The remaining road network has total distance of ";
+    if (total_dist == NO_DISTANCE) { output << "--"; }
+    else { output << total_dist; }
+    output << std::endl;
 
     view_dirty = true;
 
@@ -896,6 +1089,170 @@ MainProgram::CmdResult MainProgram::cmd_clear_roads(std::ostream& output, MainPr
     return {};
 }
 
+MainProgram::CmdResult MainProgram::cmd_prepare_routing(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    assert( begin == end && "Impossible number of parameters!");
+
+    ds_.prepare_routing();
+    output << "Routing prepared." << std::endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_prepare_landmarks(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string countstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    unsigned int count = convert_string_to<unsigned int>(countstr);
+    ds_.prepare_landmarks(count);
+    output << "Prepared " << count << " landmarks." << std::endl;
+
+    return {};
+}
+
+MainProgram::CmdResult MainProgram::cmd_distance_matrix(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string sourcesstr = *begin++;
+    string targetsstr = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    // ID lists are separated by ';'
+    auto split_ids = [](string const& idsstr)
+    {
+        vector<TownID> ids;
+        std::istringstream idsstream(idsstr);
+        for (string id; getline(idsstream, id, ';'); )
+        {
+            ids.push_back(id);
+        }
+        return ids;
+    };
+    auto sources = split_ids(sourcesstr);
+    auto targets = split_ids(targetsstr);
+
+    auto matrix = ds_.distance_matrix(sources, targets);
+
+    output << "Targets:";
+    for (auto& target : targets)
+    {
+        output << " " << target;
+    }
+    output << std::endl;
+    for (std::size_t i = 0; i < sources.size(); ++i)
+    {
+        output << sources[i] << ":";
+        for (std::size_t j = 0; j < targets.size(); ++j)
+        {
+            Distance dist = matrix[i * targets.size() + j];
+            output << " ";
+            if (dist == NO_DISTANCE) { output << "--"; }
+            else { output << dist; }
+        }
+        output << std::endl;
+    }
+
+    return {};
+}
+
+void MainProgram::test_distance_matrix()
+{
+    if (random_towns_added_ > 0)
+    {
+        // Choose random sources and targets
+        vector<TownID> sources;
+        vector<TownID> targets;
+        for (int i = 0; i < 10; ++i)
+        {
+            sources.push_back(n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_)));
+            targets.push_back(n_to_townid(random<decltype(random_towns_added_)>(0, random_towns_added_)));
+        }
+        ds_.distance_matrix(sources, targets);
+    }
+}
+
+MainProgram::CmdResult MainProgram::cmd_batch_routes(std::ostream& output, MainProgram::MatchIter begin, MainProgram::MatchIter end)
+{
+    string filename = *begin++;
+    assert( begin == end && "Impossible number of parameters!");
+
+    ifstream input(filename);
+    if (!input)
+    {
+        output << "Cannot open file '" << filename << "'!" << endl;
+        return {};
+    }
+
+    // Each line is a route command and two town IDs. Empty lines and lines
+    // starting with '#' are skipped.
+    using RouteFunc = std::vector<TownID> (Datastructures::*)(TownID, TownID);
+    unordered_map<string, RouteFunc> const route_funcs = {
+        {"any_route", &Datastructures::any_route},
+        {"least_towns_route", &Datastructures::least_towns_route},
+        {"shortest_route", &Datastructures::shortest_route}};
+    vector<Datastructures::Route_request> requests;
+    vector<string> cmds;
+    unsigned int line_num = 0;
+    for (string line; getline(input, line); )
+    {
+        ++line_num;
+        std::istringstream linestream(line);
+        string cmd;
+        TownID fromid;
+        TownID toid;
+        if (!(linestream >> cmd) || cmd.front() == '#')
+        {
+            continue;
+        }
+        auto func = route_funcs.find(cmd);
+        if (func == route_funcs.end() || !(linestream >> fromid >> toid))
+        {
+            output << "Invalid route request on line " << line_num << " of '" << filename << "'!" << endl;
+            return {};
+        }
+        requests.push_back({func->second, fromid, toid});
+        cmds.push_back(cmd);
+    }
+
+    auto routes = ds_.batch_routes(requests);
+
+    for (std::size_t i = 0; i < requests.size(); ++i)
+    {
+        output << i+1 << ". " << cmds[i] << " " << requests[i].fromid << " " << requests[i].toid << ": ";
+        auto& route = routes[i];
+        if (route.size() == 1 && route.front() == NO_TOWNID)
+        {
+            output << "Failed (NO_TOWNID returned)!!" << endl;
+            continue;
+        }
+        if (route.empty())
+        {
+            output << "No route found." << endl;
+            continue;
+        }
+        // Long routes can be longer than Distance, so they are summed in 64 bits.
+        long long dist = 0;
+        bool has_distance = true;
+        for (std::size_t j = 0; j < route.size(); ++j)
+        {
+            if (j > 0)
+            {
+                output << " -> ";
+                Distance d = calc_distance(ds_.get_town_coordinates(route[j-1]), ds_.get_town_coordinates(route[j]));
+                if (d == NO_DISTANCE) { has_distance = false; }
+                else { dist += d; }
+            }
+            output << route[j];
+        }
+        output << " (distance ";
+        if (has_distance) { output << dist; }
+        else { output << "--"; }
+        output << ")" << endl;
+    }
+
+    return {};
+}
+
 void MainProgram::test_trim_road_network()
 {
     ds_.trim_road_network();
@@ -1146,6 +1503,7 @@ std::string MainProgram::print_coord(Coord coord, std::ostream& output, bool nl)
 }
 
 string const townidx = "([a-zA-Z0-9]+)";
+string const townlistx = "([a-zA-Z0-9]+(?:;[a-zA-Z0-9]+)*)";
 string const namex = "([a-zA-Z0-9-]+)";
 string const numx = "([0-9]+)";
 string const optcoordx = "\\([[:space:]]*[0-9]+[[:space:]]*,[[:space:]]*[0-9]+[[:space:]]*\\)";
@@ -1170,24 +1528,36 @@ vector<MainProgram::CmdInfo> MainProgram::cmds_ =
                                           &MainProgram::NoParListTestCmd<&Datastructures::towns_distance_increasing> },
     {"mindist", "", "", &MainProgram::NoParTownCmd<&Datastructures::min_distance>, &MainProgram::NoParTownTestCmd<&Datastructures::min_distance> },
     {"maxdist", "", "", &MainProgram::NoParTownCmd<&Datastructures::max_distance>, &MainProgram::NoParTownTestCmd<&Datastructures::max_distance> },
-    {"towns_nearest", "(x,y)", coordx, &MainProgram::cmd_towns_nearest, &MainProgram::test_towns_nearest },
+    {"towns_nearest", "(x,y) [count]", coordx+"(?:"+wsx+numx+")?", &MainProgram::cmd_towns_nearest, &MainProgram::test_towns_nearest },
     {"remove_town", "ID", townidx, &MainProgram::cmd_remove_town, &MainProgram::test_remove_town },
     {"find_towns", "name", namex, &MainProgram::cmd_find_towns, &MainProgram::test_find_towns },
     {"change_town_name", "ID newname", townidx+wsx+namex, &MainProgram::cmd_change_town_name, &MainProgram::test_change_town_name },
     {"add_vassalship", "VassalID TaxerID", townidx+wsx+townidx, &MainProgram::cmd_add_vassalship, nullptr },
+    {"change_master", "VassalID MasterID", townidx+wsx+townidx, &MainProgram::cmd_change_master, nullptr },
     {"town_vassals", "TownID", townidx, &MainProgram::cmd_town_vassals, &MainProgram::test_town_vassals },
     {"add_road", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_add_road, nullptr },
     {"remove_road", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_remove_road, &MainProgram::test_remove_road },
     {"roads_from", "TownID", townidx, &MainProgram::cmd_roads_from, &MainProgram::test_roads_from },
+    {"same_component", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_same_component, &MainProgram::test_same_component },
     {"clear_roads", "", "", &MainProgram::cmd_clear_roads, nullptr },
     {"taxer_path", "ID", townidx, &MainProgram::cmd_taxer_path, &MainProgram::test_taxer_path },
     {"longest_vassal_path", "ID", townidx, &MainProgram::cmd_longest_vassal_path, &MainProgram::test_longest_vassal_path },
     {"total_net_tax", "ID", townidx, &MainProgram::cmd_total_net_tax, &MainProgram::test_total_net_tax },
+    {"taxer_path_view", "ID", townidx, &MainProgram::cmd_taxer_path_view, &MainProgram::test_taxer_path_view },
+    {"is_under", "VassalID MasterID", townidx+wsx+townidx, &MainProgram::cmd_is_under, &MainProgram::test_is_under },
+    {"common_master", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_common_master, &MainProgram::test_common_master },
+    {"depth", "ID", townidx, &MainProgram::cmd_depth, &MainProgram::test_depth },
+    {"taxer_path_tax", "ID", townidx, &MainProgram::cmd_taxer_path_tax, &MainProgram::test_taxer_path_tax },
     {"any_route", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_any_route, &MainProgram::test_any_route },
     {"shortest_route", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_shortest_route, &MainProgram::test_shortest_route },
     {"least_towns_route", "Town1ID Town2ID", townidx+wsx+townidx, &MainProgram::cmd_least_towns_route, &MainProgram::test_least_towns_route },
     {"road_cycle_route", "TownID", townidx, &MainProgram::cmd_road_cycle_route, &MainProgram::test_road_cycle_route },
     {"trim_road_network", "", "", &MainProgram::cmd_trim_road_network, &MainProgram::test_trim_road_network },
+    {"prepare_routing", "", "", &MainProgram::cmd_prepare_routing, nullptr },
+    {"prepare_landmarks", "number_of_landmarks", numx, &MainProgram::cmd_prepare_landmarks, nullptr },
+    {"distance_matrix", "ID1[;ID2...] ID1[;ID2...]", townlistx+wsx+townlistx,
+     &MainProgram::cmd_distance_matrix, &MainProgram::test_distance_matrix },
+    {"batch_routes", "\"in-filename\"", "\"([-a-zA-Z0-9 ./:_]+)\"", &MainProgram::cmd_batch_routes, nullptr },
     {"quit", "", "", nullptr, nullptr },
     {"help", "", "", &MainProgram::help_command, nullptr },
     {"read", "\"in-filename\" [silent]", "\"([-a-zA-Z0-9 ./:_]+)\"(?:"+wsx+"(silent))?", &MainProgram::cmd_read, nullptr },
@@ -1219,7 +1589,7 @@ MainProgram::CmdResult MainProgram::cmd_perftest(std::ostream& output, MatchIter
     try {
     // Note: everything below is indented too little by one indentation level! (because of try block above)
 
-    vector<string> optional_cmds({"remove_town", "towns_nearest", "longest_vassal_path", "total_net_tax"});
+    vector<string> optional_cmds({"remove_town", "towns_nearest", "longest_vassal_path", "total_net_tax", "distance_matrix"});
     vector<string> nondefault_cmds({"remove_town", "find_towns"});
 
     string commandstr = *begin++;
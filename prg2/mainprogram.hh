@@ -102,11 +102,17 @@ private:
     CmdResult cmd_print_town(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_change_town_name(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_vassalship(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_change_master(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_add_road(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_remove_road(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_taxer_path(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_longest_vassal_path(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_total_net_tax(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_taxer_path_view(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_is_under(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_common_master(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_depth(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_taxer_path_tax(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_towns_nearest(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_remove_town(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_town_count(std::ostream& output, MatchIter begin, MatchIter end);
@@ -114,6 +120,7 @@ private:
     CmdResult cmd_all_roads(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_town_vassals(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_roads_from(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_same_component(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_roads(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_random_road_network(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_any_route(std::ostream& output, MatchIter begin, MatchIter end);
@@ -122,6 +129,10 @@ private:
     CmdResult cmd_road_cycle_route(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_trim_road_network(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_clear_roads(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_prepare_routing(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_prepare_landmarks(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_distance_matrix(std::ostream& output, MatchIter begin, MatchIter end);
+    CmdResult cmd_batch_routes(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_clear_all(std::ostream& output, MatchIter begin, MatchIter end);
     CmdResult cmd_find_towns(std::ostream& output, MatchIter begin, MatchIter end);
 
@@ -139,6 +150,11 @@ private:
     void test_taxer_path();
     void test_longest_vassal_path();
     void test_total_net_tax();
+    void test_taxer_path_view();
+    void test_is_under();
+    void test_common_master();
+    void test_depth();
+    void test_taxer_path_tax();
     void test_remove_town();
     void test_remove_road();
     void test_change_town_name();
@@ -148,6 +164,7 @@ private:
     void test_all_roads();
     void test_town_vassals();
     void test_roads_from();
+    void test_same_component();
     void test_get_functions(TownID id);
     void test_random_roads();
     void test_any_route();
@@ -155,6 +172,7 @@ private:
     void test_least_towns_route();
     void test_road_cycle_route();
     void test_trim_road_network();
+    void test_distance_matrix();
 
     void add_random_towns(unsigned int size, Coord min = {1,1}, Coord max = {10000, 10000});
     void add_random_roads(unsigned int n);